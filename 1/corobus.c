@@ -4,63 +4,300 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
-struct data_vector {
-	unsigned *data;
-	size_t size;
+/** Capacity of a ring at its first allocation. */
+#define DATA_RING_CAPACITY_MIN 16
+
+/**
+ * Circular buffer of messages of the same size. The capacity is a
+ * power of 2, so as the positions wrap with a mask. It grows on
+ * demand, so a channel takes memory only for as many messages as
+ * it ever held at once.
+ */
+struct data_ring {
+	char *data;
+	/** Size of one message. */
+	size_t item_size;
+	/** 0 or a power of 2. */
 	size_t capacity;
+	/** Position of the first message. */
+	size_t head;
+	/** Number of the messages. */
+	size_t size;
 };
 
-#if 0 /* Uncomment this if want to use */
+static void
+data_ring_create(struct data_ring *ring, size_t item_size)
+{
+	ring->data = NULL;
+	ring->item_size = item_size;
+	ring->capacity = 0;
+	ring->head = 0;
+	ring->size = 0;
+}
 
-/** Append @a count messages in @a data to the end of the vector. */
 static void
-data_vector_append_many(struct data_vector *vector,
-	const unsigned *data, size_t count)
+data_ring_destroy(struct data_ring *ring)
 {
-	if (vector->size + count > vector->capacity) {
-		if (vector->capacity == 0)
-			vector->capacity = 4;
-		else
-			vector->capacity *= 2;
-		if (vector->capacity < vector->size + count)
-			vector->capacity = vector->size + count;
-		vector->data = realloc(vector->data,
-			sizeof(vector->data[0]) * vector->capacity);
-	}
-	memcpy(&vector->data[vector->size], data, sizeof(data[0]) * count);
-	vector->size += count;
+	free(ring->data);
+}
+
+/**
+ * Copy @a count messages out of the ring starting from the
+ * position @a pos, in at most two pieces - till the end of the
+ * buffer, and the rest from its beginning.
+ */
+static void
+data_ring_copy_out(const struct data_ring *ring, size_t pos, void *data,
+	size_t count)
+{
+	size_t first = ring->capacity - pos;
+	if (first > count)
+		first = count;
+	size_t item_size = ring->item_size;
+	memcpy(data, &ring->data[pos * item_size], first * item_size);
+	memcpy((char *)data + first * item_size, ring->data,
+		(count - first) * item_size);
 }
 
-/** Append a single message to the vector. */
+/** Make room for at least @a size messages. */
 static void
-data_vector_append(struct data_vector *vector, unsigned data)
+data_ring_reserve(struct data_ring *ring, size_t size)
 {
-	data_vector_append_many(vector, &data, 1);
+	if (size <= ring->capacity)
+		return;
+	size_t capacity = ring->capacity;
+	if (capacity < DATA_RING_CAPACITY_MIN)
+		capacity = DATA_RING_CAPACITY_MIN;
+	while (capacity < size)
+		capacity *= 2;
+	char *data = malloc(ring->item_size * capacity);
+	if (ring->size != 0)
+		data_ring_copy_out(ring, ring->head, data, ring->size);
+	free(ring->data);
+	ring->data = data;
+	ring->capacity = capacity;
+	ring->head = 0;
 }
 
-/** Pop @a count of messages into @a data from the head of the vector. */
+/** Append @a count messages in @a data to the end of the ring. */
 static void
-data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t count)
+data_ring_push_many(struct data_ring *ring, const void *data, size_t count)
 {
-	assert(count <= vector->size);
-	memcpy(data, vector->data, sizeof(data[0]) * count);
-	vector->size -= count;
-	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+	data_ring_reserve(ring, ring->size + count);
+	size_t mask = ring->capacity - 1;
+	size_t tail = (ring->head + ring->size) & mask;
+	size_t first = ring->capacity - tail;
+	if (first > count)
+		first = count;
+	size_t item_size = ring->item_size;
+	memcpy(&ring->data[tail * item_size], data, first * item_size);
+	memcpy(ring->data, (const char *)data + first * item_size,
+		(count - first) * item_size);
+	ring->size += count;
 }
 
-/** Pop a single message from the head of the vector. */
-static unsigned
-data_vector_pop_first(struct data_vector *vector)
+/** Pop @a count of messages into @a data from the head of the ring. */
+static void
+data_ring_pop_many(struct data_ring *ring, void *data, size_t count)
 {
-	unsigned data = 0;
-	data_vector_pop_first_many(vector, &data, 1);
-	return data;
+	assert(count <= ring->size);
+	if (count == 0)
+		return;
+	data_ring_copy_out(ring, ring->head, data, count);
+	ring->head = (ring->head + count) & (ring->capacity - 1);
+	ring->size -= count;
 }
 
+/** Size of the CPU cache line, to keep the hot fields apart. */
+#define CORO_BUS_CACHE_LINE 64
+
+/**
+ * Pause in a spin loop. After a number of attempts give the CPU
+ * away - the thread being waited for might be preempted and need
+ * this CPU to make progress.
+ */
+static inline void
+coro_bus_cpu_relax(int attempt)
+{
+	if (attempt >= 128) {
+		sched_yield();
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
 #endif
+}
+
+struct mpmc_cell {
+	/**
+	 * Position which may use the cell next. It equals the push
+	 * position when the cell is free, and the pop position plus
+	 * one when the cell has a message.
+	 */
+	size_t seq;
+	unsigned data;
+};
+
+/**
+ * Bounded lock-free queue for many producers and many consumers,
+ * used by the channels of the thread-safe bus. A producer takes a
+ * position with a CAS, fills the cell, and publishes it by the
+ * cell's sequence number. A consumer does the same on the other
+ * side. The capacity is a power of 2 and is allocated at once.
+ */
+struct mpmc_queue {
+	struct mpmc_cell *cells;
+	size_t mask;
+	/**
+	 * Max messages in the queue. A single cell can't tell a full
+	 * queue from a free one by the sequence, so there are always
+	 * at least 2 cells, and the limit is checked by the positions.
+	 */
+	size_t limit;
+	char pad1[CORO_BUS_CACHE_LINE];
+	/** Next position to push to. */
+	size_t push_pos;
+	char pad2[CORO_BUS_CACHE_LINE];
+	/** Next position to pop from. */
+	size_t pop_pos;
+	char pad3[CORO_BUS_CACHE_LINE];
+};
+
+static void
+mpmc_queue_create(struct mpmc_queue *queue, size_t capacity)
+{
+	size_t pow2 = 1;
+	while (pow2 < capacity)
+		pow2 *= 2;
+	queue->limit = pow2;
+	if (pow2 < 2)
+		pow2 = 2;
+	queue->cells = malloc(sizeof(queue->cells[0]) * pow2);
+	for (size_t i = 0; i < pow2; ++i)
+		queue->cells[i].seq = i;
+	queue->mask = pow2 - 1;
+	queue->push_pos = 0;
+	queue->pop_pos = 0;
+}
+
+static void
+mpmc_queue_destroy(struct mpmc_queue *queue)
+{
+	free(queue->cells);
+}
+
+/** Push the message. Return false if the queue is full. */
+static bool
+mpmc_queue_push(struct mpmc_queue *queue, unsigned data)
+{
+	size_t pos = __atomic_load_n(&queue->push_pos, __ATOMIC_RELAXED);
+	while (true) {
+		struct mpmc_cell *cell = &queue->cells[pos & queue->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			size_t pop = __atomic_load_n(&queue->pop_pos,
+				__ATOMIC_ACQUIRE);
+			/* A stale push position gives a negative count. */
+			if ((intptr_t)(pos - pop) >= (intptr_t)queue->limit)
+				return false;
+			if (__atomic_compare_exchange_n(&queue->push_pos, &pos,
+				pos + 1, true, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+				cell->data = data;
+				__atomic_store_n(&cell->seq, pos + 1,
+					__ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (diff < 0) {
+			/* The cell still has a message of the last round. */
+			return false;
+		} else {
+			pos = __atomic_load_n(&queue->push_pos,
+				__ATOMIC_RELAXED);
+		}
+	}
+}
+
+/** Pop a message. Return false if the queue is empty. */
+static bool
+mpmc_queue_pop(struct mpmc_queue *queue, unsigned *data)
+{
+	size_t pos = __atomic_load_n(&queue->pop_pos, __ATOMIC_RELAXED);
+	while (true) {
+		struct mpmc_cell *cell = &queue->cells[pos & queue->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->pop_pos, &pos,
+				pos + 1, true, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+				*data = cell->data;
+				__atomic_store_n(&cell->seq,
+					pos + queue->mask + 1,
+					__ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (diff < 0) {
+			/* Not pushed yet. */
+			return false;
+		} else {
+			pos = __atomic_load_n(&queue->pop_pos,
+				__ATOMIC_RELAXED);
+		}
+	}
+}
+
+/** Check if the queue looks empty. It can change right away. */
+static inline bool
+mpmc_queue_is_empty(const struct mpmc_queue *queue)
+{
+	return __atomic_load_n(&queue->pop_pos, __ATOMIC_RELAXED) ==
+		__atomic_load_n(&queue->push_pos, __ATOMIC_RELAXED);
+}
+
+/** Check if the queue looks full. It can change right away. */
+static inline bool
+mpmc_queue_is_full(const struct mpmc_queue *queue)
+{
+	return __atomic_load_n(&queue->push_pos, __ATOMIC_RELAXED) -
+		__atomic_load_n(&queue->pop_pos, __ATOMIC_RELAXED) >=
+		queue->limit;
+}
+
+/** Payloads up to this size are stored right in the ring. */
+#define CORO_BUS_MSG_INLINE_SIZE 16
+
+/** A message of a channel opened with coro_bus_channel_open_msg(). */
+struct coro_bus_msg {
+	/** Payload size. */
+	size_t size;
+	/** True if the payload is in the message, not in ptr. */
+	bool is_inline;
+	union {
+		/** Payload allocated with malloc(), owned by the message. */
+		void *ptr;
+		char bytes[CORO_BUS_MSG_INLINE_SIZE];
+	} payload;
+};
+
+static void
+coro_bus_msg_destroy(struct coro_bus_msg *msg)
+{
+	if (!msg->is_inline)
+		free(msg->payload.ptr);
+}
 
 /**
  * One coroutine waiting to be woken up in a list of other
@@ -76,8 +313,6 @@ struct wakeup_queue {
 	struct rlist coros;
 };
 
-#if 0 /* Uncomment this if want to use */
-
 /** Suspend the current coroutine until it is woken up. */
 static void
 wakeup_queue_suspend_this(struct wakeup_queue *queue)
@@ -86,6 +321,10 @@ wakeup_queue_suspend_this(struct wakeup_queue *queue)
 	entry.coro = coro_this();
 	rlist_add_tail_entry(&queue->coros, &entry, base);
 	coro_suspend();
+	/*
+	 * The queue might be gone already, but then the entry was
+	 * taken out of it and points at itself.
+	 */
 	rlist_del_entry(&entry, base);
 }
 
@@ -100,25 +339,273 @@ wakeup_queue_wakeup_first(struct wakeup_queue *queue)
 	coro_wakeup(entry->coro);
 }
 
-#endif
+/**
+ * Wakeup all the coroutines and take them out of the queue, so as
+ * it could be deleted before they run.
+ */
+static void
+wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+{
+	while (!rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_shift_entry(&queue->coros,
+			struct wakeup_entry, base);
+		coro_wakeup(entry->coro);
+	}
+}
+
+/**
+ * A waiter of the thread-safe bus. It is either a coroutine of any
+ * engine, woken up with coro_wakeup_remote(), or a plain thread
+ * sleeping on a futex.
+ */
+struct mt_wait_entry {
+	struct rlist base;
+	/** NULL for a plain thread. */
+	struct coro *coro;
+	/**
+	 * Set by the waker, which takes the entry out of the queue.
+	 * The futex of a plain thread.
+	 */
+	int is_woken;
+};
+
+/** A queue of the waiters shared by threads. */
+struct mt_wait_queue {
+	/** Spinlock protecting the list. */
+	bool lock;
+	/**
+	 * Number of the waiters. The wakers check it without the
+	 * lock, so the fast path doesn't take it at all.
+	 */
+	int count;
+	struct rlist entries;
+};
+
+static void
+mt_wait_queue_create(struct mt_wait_queue *queue)
+{
+	queue->lock = false;
+	queue->count = 0;
+	rlist_create(&queue->entries);
+}
+
+static inline void
+mt_wait_queue_lock(struct mt_wait_queue *queue)
+{
+	for (int i = 0; __atomic_test_and_set(&queue->lock, __ATOMIC_ACQUIRE);
+	     ++i)
+		coro_bus_cpu_relax(i);
+}
+
+static inline void
+mt_wait_queue_unlock(struct mt_wait_queue *queue)
+{
+	__atomic_clear(&queue->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Put the current coroutine or thread into the queue. The caller
+ * must check its condition once more after that and either cancel
+ * the wait or park. A waker changes the condition before checking
+ * the queue, so one of them is going to see the other.
+ */
+static void
+mt_wait_queue_add(struct mt_wait_queue *queue, struct mt_wait_entry *entry)
+{
+	entry->coro = coro_this();
+	entry->is_woken = 0;
+	mt_wait_queue_lock(queue);
+	rlist_add_tail_entry(&queue->entries, entry, base);
+	__atomic_add_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+	mt_wait_queue_unlock(queue);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/** Sleep until the entry is taken out of its queue by a waker. */
+static void
+mt_wait_entry_park(struct mt_wait_entry *entry)
+{
+	if (entry->coro != NULL) {
+		/*
+		 * Each taken entry gets exactly one remote wakeup, and
+		 * it must be consumed, even if the flag is set already.
+		 */
+		do {
+			coro_suspend_remote();
+		} while (__atomic_load_n(&entry->is_woken,
+			__ATOMIC_ACQUIRE) == 0);
+		return;
+	}
+	while (__atomic_load_n(&entry->is_woken, __ATOMIC_ACQUIRE) == 0)
+		syscall(SYS_futex, &entry->is_woken, FUTEX_WAIT_PRIVATE, 0,
+			NULL, NULL, 0);
+}
+
+/**
+ * Take the entry out of the queue when the wait is not needed
+ * anymore. If a waker has taken it already, its wakeup is consumed.
+ */
+static void
+mt_wait_queue_cancel(struct mt_wait_queue *queue, struct mt_wait_entry *entry)
+{
+	mt_wait_queue_lock(queue);
+	bool is_woken = __atomic_load_n(&entry->is_woken, __ATOMIC_RELAXED);
+	if (!is_woken) {
+		rlist_del_entry(entry, base);
+		__atomic_sub_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+	}
+	mt_wait_queue_unlock(queue);
+	if (is_woken)
+		mt_wait_entry_park(entry);
+}
+
+/**
+ * Take the first waiter out of the queue, the lock must be taken.
+ * It must be woken up with mt_wait_entry_wakeup() after the unlock.
+ */
+static struct mt_wait_entry *
+mt_wait_queue_shift(struct mt_wait_queue *queue, struct coro **coro)
+{
+	struct mt_wait_entry *entry = rlist_shift_entry(&queue->entries,
+		struct mt_wait_entry, base);
+	__atomic_sub_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+	/* The waiter can leave right after the flag is set. */
+	*coro = entry->coro;
+	__atomic_store_n(&entry->is_woken, 1, __ATOMIC_RELEASE);
+	return entry;
+}
+
+static void
+mt_wait_entry_wakeup(struct mt_wait_entry *entry, struct coro *coro)
+{
+	if (coro != NULL) {
+		coro_wakeup_remote(coro);
+		return;
+	}
+	/*
+	 * The thread might have seen the flag and left already. Then
+	 * the futex is a nop, or a spurious wakeup for whoever waits
+	 * on the same address now, and they check their flags.
+	 */
+	syscall(SYS_futex, &entry->is_woken, FUTEX_WAKE_PRIVATE, 1, NULL,
+		NULL, 0);
+}
+
+/**
+ * Wake up the first waiter, if there are any. The caller must have
+ * changed the condition and issued a full barrier before.
+ */
+static void
+mt_wait_queue_wakeup_first(struct mt_wait_queue *queue)
+{
+	if (__atomic_load_n(&queue->count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	mt_wait_queue_lock(queue);
+	if (rlist_empty(&queue->entries)) {
+		mt_wait_queue_unlock(queue);
+		return;
+	}
+	struct coro *coro;
+	struct mt_wait_entry *entry = mt_wait_queue_shift(queue, &coro);
+	mt_wait_queue_unlock(queue);
+	mt_wait_entry_wakeup(entry, coro);
+}
+
+/** Wake up all the waiters, the queue can be deleted after that. */
+static void
+mt_wait_queue_wakeup_all(struct mt_wait_queue *queue)
+{
+	mt_wait_queue_lock(queue);
+	while (!rlist_empty(&queue->entries)) {
+		struct coro *coro;
+		struct mt_wait_entry *entry = mt_wait_queue_shift(queue,
+			&coro);
+		mt_wait_entry_wakeup(entry, coro);
+	}
+	mt_wait_queue_unlock(queue);
+}
 
 struct coro_bus_channel {
 	/** Channel max capacity. */
 	size_t size_limit;
+	/** Max total payload size of the messages in the channel. */
+	size_t byte_limit;
+	/** Total payload size of the messages in the channel. */
+	size_t byte_count;
+	/**
+	 * True if the channel carries struct coro_bus_msg, not
+	 * unsigned numbers.
+	 */
+	bool is_msg;
 	/** Coroutines waiting until the channel is not full. */
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
 	/** Message queue. */
-	struct data_vector data;
+	struct data_ring data;
+	/** Message queue of the thread-safe bus, instead of data. */
+	struct mpmc_queue mpmc;
+	/** Waiters of the thread-safe bus, instead of the other queues. */
+	struct mt_wait_queue mt_send_queue;
+	struct mt_wait_queue mt_recv_queue;
+};
+
+/**
+ * A descriptor is the index of the channel's slot in the low bits,
+ * and the generation of the slot in the high ones. The generation
+ * changes on each close, so a descriptor of a closed channel
+ * doesn't work with another channel opened in the same slot, until
+ * the generation wraps around.
+ */
+#define CORO_BUS_SLOT_BITS 20
+#define CORO_BUS_SLOT_MAX (1 << CORO_BUS_SLOT_BITS)
+#define CORO_BUS_GEN_MASK ((1u << (31 - CORO_BUS_SLOT_BITS)) - 1)
+
+/**
+ * The slots are allocated by chunks which never move, so as the
+ * thread-safe bus could find the channels without a lock while
+ * others are opened.
+ */
+#define CORO_BUS_CHUNK_BITS 10
+#define CORO_BUS_CHUNK_SIZE (1 << CORO_BUS_CHUNK_BITS)
+#define CORO_BUS_CHUNK_COUNT (CORO_BUS_SLOT_MAX / CORO_BUS_CHUNK_SIZE)
+
+struct coro_bus_slot {
+	/** NULL if the slot is free. */
+	struct coro_bus_channel *channel;
+	/** Generation, a part of the descriptor. */
+	unsigned gen;
+	/** Next slot in the free list, or -1. */
+	int next_free;
 };
 
 struct coro_bus {
-	struct coro_bus_channel **channels;
-	int channel_count;
+	struct coro_bus_slot *chunks[CORO_BUS_CHUNK_COUNT];
+	/** Number of the slots ever used. */
+	int slot_count;
+	/**
+	 * Free slots, in the order of closing. The oldest one is
+	 * reused first, so as the generations of all the free slots
+	 * advance evenly.
+	 */
+	int free_head;
+	int free_tail;
+	/** True if the bus is created by coro_bus_new_mt(). */
+	bool is_mt;
+	/** Protects opening and closing of the thread-safe bus. */
+	pthread_mutex_t mutex;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+static inline struct coro_bus_slot *
+coro_bus_slot(struct coro_bus *bus, int id)
+{
+	struct coro_bus_slot *chunk = __atomic_load_n(
+		&bus->chunks[id >> CORO_BUS_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	return &chunk[id & (CORO_BUS_CHUNK_SIZE - 1)];
+}
+
+/** Each thread has its own error, like errno. */
+static __thread enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
 
 enum coro_bus_error_code
 coro_bus_errno(void)
@@ -132,172 +619,906 @@ coro_bus_errno_set(enum coro_bus_error_code err)
 	global_error = err;
 }
 
+/**
+ * Find the channel by its descriptor.
+ * @retval NULL No such channel. The error is not set.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_find(struct coro_bus *bus, int channel)
+{
+	if (channel < 0)
+		return NULL;
+	int id = channel & (CORO_BUS_SLOT_MAX - 1);
+	if (id >= __atomic_load_n(&bus->slot_count, __ATOMIC_ACQUIRE))
+		return NULL;
+	struct coro_bus_slot *slot = coro_bus_slot(bus, id);
+	unsigned gen = (unsigned)channel >> CORO_BUS_SLOT_BITS;
+	if (__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != gen)
+		return NULL;
+	struct coro_bus_channel *ch = __atomic_load_n(&slot->channel,
+		__ATOMIC_ACQUIRE);
+	/* The slot could be reused in between by another thread. */
+	if (__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != gen)
+		return NULL;
+	return ch;
+}
+
+/**
+ * Get the channel by its descriptor.
+ * @retval NULL No such channel, the error is set.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_get(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_find(bus, channel);
+	if (ch == NULL)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return ch;
+}
+
+/**
+ * Get the channel by its descriptor and check it carries the
+ * given kind of messages.
+ * @retval NULL No such channel or a wrong one, the error is set.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_get_of(struct coro_bus *bus, int channel, bool is_msg)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch != NULL && ch->is_msg != is_msg) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_TYPE);
+		return NULL;
+	}
+	return ch;
+}
+
+/**
+ * Check if the channel can't take any more messages. A not full
+ * one still might have no space for a big message.
+ */
+static inline bool
+coro_bus_channel_is_full(const struct coro_bus_channel *ch)
+{
+	return ch->data.size >= ch->size_limit ||
+		(ch->byte_count != 0 && ch->byte_count >= ch->byte_limit);
+}
+
+/**
+ * Check if a message with the payload of the given size fits. A
+ * message bigger than the byte limit fits only into an empty
+ * channel, otherwise it could never be sent.
+ */
+static inline bool
+coro_bus_channel_fits(const struct coro_bus_channel *ch, size_t size)
+{
+	if (ch->data.size >= ch->size_limit)
+		return false;
+	if (ch->byte_count == 0)
+		return true;
+	return ch->byte_count < ch->byte_limit &&
+		size <= ch->byte_limit - ch->byte_count;
+}
+
+/**
+ * Put as many of the messages as fit into the channel and let a
+ * receiver know. There must be space for at least one.
+ * @return Number of the sent messages.
+ */
+static unsigned
+coro_bus_channel_push(struct coro_bus_channel *ch, const unsigned *data,
+	unsigned count)
+{
+	assert(!coro_bus_channel_is_full(ch));
+	size_t space = ch->size_limit - ch->data.size;
+	if (count > space)
+		count = space;
+	data_ring_push_many(&ch->data, data, count);
+	wakeup_queue_wakeup_first(&ch->recv_queue);
+	return count;
+}
+
+/**
+ * Take as many messages as there are, up to the capacity, and let
+ * a sender know. The channel must not be empty.
+ * @return Number of the received messages.
+ */
+static unsigned
+coro_bus_channel_pop(struct coro_bus_channel *ch, unsigned *data,
+	unsigned capacity)
+{
+	assert(ch->data.size > 0);
+	if (capacity > ch->data.size)
+		capacity = ch->data.size;
+	data_ring_pop_many(&ch->data, data, capacity);
+	wakeup_queue_wakeup_first(&ch->send_queue);
+	return capacity;
+}
+
+/** Put the message into the channel, it must fit. */
+static void
+coro_bus_channel_push_msg(struct coro_bus_channel *ch,
+	const struct coro_bus_msg *msg)
+{
+	assert(coro_bus_channel_fits(ch, msg->size));
+	data_ring_push_many(&ch->data, msg, 1);
+	ch->byte_count += msg->size;
+	wakeup_queue_wakeup_first(&ch->recv_queue);
+}
+
+/** Take the first message of the channel, it must not be empty. */
+static void
+coro_bus_channel_pop_msg(struct coro_bus_channel *ch,
+	struct coro_bus_msg *msg)
+{
+	assert(ch->data.size > 0);
+	data_ring_pop_many(&ch->data, msg, 1);
+	ch->byte_count -= msg->size;
+	wakeup_queue_wakeup_first(&ch->send_queue);
+}
+
+static void
+coro_bus_channel_delete(struct coro_bus_channel *ch, bool is_mt)
+{
+	if (is_mt)
+		mpmc_queue_destroy(&ch->mpmc);
+	if (ch->is_msg) {
+		/* Nobody is going to receive them anymore. */
+		struct coro_bus_msg msg;
+		while (ch->data.size > 0) {
+			data_ring_pop_many(&ch->data, &msg, 1);
+			coro_bus_msg_destroy(&msg);
+		}
+	}
+	data_ring_destroy(&ch->data);
+	free(ch);
+}
+
 struct coro_bus *
 coro_bus_new(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return NULL;
+	struct coro_bus *bus = malloc(sizeof(*bus));
+	memset(bus->chunks, 0, sizeof(bus->chunks));
+	bus->slot_count = 0;
+	bus->free_head = -1;
+	bus->free_tail = -1;
+	bus->is_mt = false;
+	return bus;
+}
+
+struct coro_bus *
+coro_bus_new_mt(void)
+{
+	struct coro_bus *bus = coro_bus_new();
+	bus->is_mt = true;
+	pthread_mutex_init(&bus->mutex, NULL);
+	return bus;
 }
 
 void
 coro_bus_delete(struct coro_bus *bus)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
+	for (int i = 0; i < bus->slot_count; ++i) {
+		struct coro_bus_channel *ch = coro_bus_slot(bus, i)->channel;
+		if (ch == NULL)
+			continue;
+		assert(rlist_empty(&ch->send_queue.coros));
+		assert(rlist_empty(&ch->recv_queue.coros));
+		assert(rlist_empty(&ch->mt_send_queue.entries));
+		assert(rlist_empty(&ch->mt_recv_queue.entries));
+		coro_bus_channel_delete(ch, bus->is_mt);
+	}
+	for (int i = 0; i < CORO_BUS_CHUNK_COUNT; ++i)
+		free(bus->chunks[i]);
+	if (bus->is_mt)
+		pthread_mutex_destroy(&bus->mutex);
+	free(bus);
+}
+
+/**
+ * Find a free slot for a new channel and return its index, or -1
+ * with the error set.
+ */
+static int
+coro_bus_slot_take(struct coro_bus *bus)
+{
+	int id = bus->free_head;
+	if (id >= 0) {
+		bus->free_head = coro_bus_slot(bus, id)->next_free;
+		if (bus->free_head < 0)
+			bus->free_tail = -1;
+		return id;
+	}
+	id = bus->slot_count;
+	/* More slots would not fit into a descriptor. */
+	if (id >= CORO_BUS_SLOT_MAX) {
+		coro_bus_errno_set(CORO_BUS_ERR_TOO_MANY_CHANNELS);
+		return -1;
+	}
+	int chunk = id >> CORO_BUS_CHUNK_BITS;
+	if (bus->chunks[chunk] == NULL) {
+		struct coro_bus_slot *slots = malloc(sizeof(slots[0]) *
+			CORO_BUS_CHUNK_SIZE);
+		if (slots == NULL) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_MEMORY);
+			return -1;
+		}
+		__atomic_store_n(&bus->chunks[chunk], slots, __ATOMIC_RELEASE);
+	}
+	struct coro_bus_slot *slot = coro_bus_slot(bus, id);
+	slot->channel = NULL;
+	slot->gen = 0;
+	__atomic_store_n(&bus->slot_count, id + 1, __ATOMIC_RELEASE);
+	return id;
+}
+
+/** Create a channel with the given limits and give it a descriptor. */
+static int
+coro_bus_channel_add(struct coro_bus *bus, size_t size_limit,
+	size_t byte_limit, bool is_msg)
+{
+	struct coro_bus_channel *ch = malloc(sizeof(*ch));
+	ch->size_limit = size_limit;
+	ch->byte_limit = byte_limit;
+	ch->byte_count = 0;
+	ch->is_msg = is_msg;
+	rlist_create(&ch->send_queue.coros);
+	rlist_create(&ch->recv_queue.coros);
+	data_ring_create(&ch->data, is_msg ? sizeof(struct coro_bus_msg) :
+		sizeof(unsigned));
+	mt_wait_queue_create(&ch->mt_send_queue);
+	mt_wait_queue_create(&ch->mt_recv_queue);
+	if (bus->is_mt) {
+		mpmc_queue_create(&ch->mpmc, size_limit);
+		ch->size_limit = ch->mpmc.limit;
+		pthread_mutex_lock(&bus->mutex);
+	}
+	int id = coro_bus_slot_take(bus);
+	if (id < 0) {
+		if (bus->is_mt)
+			pthread_mutex_unlock(&bus->mutex);
+		coro_bus_channel_delete(ch, bus->is_mt);
+		return -1;
+	}
+	struct coro_bus_slot *slot = coro_bus_slot(bus, id);
+	slot->next_free = -1;
+	__atomic_store_n(&slot->channel, ch, __ATOMIC_RELEASE);
+	int channel = (int)(slot->gen << CORO_BUS_SLOT_BITS) | id;
+	if (bus->is_mt)
+		pthread_mutex_unlock(&bus->mutex);
+	return channel;
 }
 
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)size_limit;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_channel_add(bus, size_limit, SIZE_MAX, false);
+}
+
+int
+coro_bus_channel_open_msg(struct coro_bus *bus, size_t size_limit,
+	size_t byte_limit)
+{
+	if (bus->is_mt) {
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	return coro_bus_channel_add(bus, size_limit, byte_limit, true);
 }
 
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
+	if (bus->is_mt)
+		pthread_mutex_lock(&bus->mutex);
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	assert(ch != NULL);
+	int id = channel & (CORO_BUS_SLOT_MAX - 1);
+	struct coro_bus_slot *slot = coro_bus_slot(bus, id);
+	/* The new generation first, so as the lookups fail right away. */
+	__atomic_store_n(&slot->gen, (slot->gen + 1) & CORO_BUS_GEN_MASK,
+		__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->channel, NULL, __ATOMIC_RELEASE);
+	if (bus->free_tail >= 0)
+		coro_bus_slot(bus, bus->free_tail)->next_free = id;
+	else
+		bus->free_head = id;
+	bus->free_tail = id;
+	if (bus->is_mt)
+		pthread_mutex_unlock(&bus->mutex);
+	/* They will find the channel missing when run. */
+	wakeup_queue_wakeup_all(&ch->send_queue);
+	wakeup_queue_wakeup_all(&ch->recv_queue);
+	mt_wait_queue_wakeup_all(&ch->mt_send_queue);
+	mt_wait_queue_wakeup_all(&ch->mt_recv_queue);
+	coro_bus_channel_delete(ch, bus->is_mt);
+}
+
+/**
+ * Send a message to a channel of the thread-safe bus, waiting for
+ * space if @a is_blocking. The fast path is a CAS in the queue and
+ * a check for the waiting receivers.
+ */
+static int
+coro_bus_send_mt(struct coro_bus *bus, int channel, unsigned data,
+	bool is_blocking)
+{
+	struct mt_wait_entry entry;
+	struct coro_bus_channel *ch;
+	bool is_waited = false;
+	while (true) {
+		ch = coro_bus_channel_get_of(bus, channel, false);
+		if (ch == NULL)
+			return -1;
+		if (mpmc_queue_push(&ch->mpmc, data))
+			break;
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		mt_wait_queue_add(&ch->mt_send_queue, &entry);
+		is_waited = true;
+		if (mpmc_queue_push(&ch->mpmc, data)) {
+			mt_wait_queue_cancel(&ch->mt_send_queue, &entry);
+			break;
+		}
+		/* After the wakeup the channel might be gone. */
+		mt_wait_entry_park(&entry);
+	}
+	/* Pairs with the fence of a receiver going to sleep. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	mt_wait_queue_wakeup_first(&ch->mt_recv_queue);
+	/* A taken wakeup could be meant for another sender. */
+	if (is_waited && !mpmc_queue_is_full(&ch->mpmc))
+		mt_wait_queue_wakeup_first(&ch->mt_send_queue);
+	return 0;
+}
+
+/** Same as coro_bus_send_mt(), but the other way. */
+static int
+coro_bus_recv_mt(struct coro_bus *bus, int channel, unsigned *data,
+	bool is_blocking)
+{
+	struct mt_wait_entry entry;
+	struct coro_bus_channel *ch;
+	bool is_waited = false;
+	while (true) {
+		ch = coro_bus_channel_get_of(bus, channel, false);
+		if (ch == NULL)
+			return -1;
+		if (mpmc_queue_pop(&ch->mpmc, data))
+			break;
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		mt_wait_queue_add(&ch->mt_recv_queue, &entry);
+		is_waited = true;
+		if (mpmc_queue_pop(&ch->mpmc, data)) {
+			mt_wait_queue_cancel(&ch->mt_recv_queue, &entry);
+			break;
+		}
+		mt_wait_entry_park(&entry);
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	mt_wait_queue_wakeup_first(&ch->mt_send_queue);
+	if (is_waited && !mpmc_queue_is_empty(&ch->mpmc))
+		mt_wait_queue_wakeup_first(&ch->mt_recv_queue);
+	return 0;
+}
+
+/**
+ * The batches of the thread-safe bus - the first message waits if
+ * @a is_blocking, the rest are sent while there is space.
+ */
+static int
+coro_bus_send_v_mt(struct coro_bus *bus, int channel, const unsigned *data,
+	unsigned count, bool is_blocking)
+{
+	if (coro_bus_send_mt(bus, channel, data[0], is_blocking) != 0)
+		return -1;
+	unsigned sent = 1;
+	while (sent < count &&
+	       coro_bus_send_mt(bus, channel, data[sent], false) == 0)
+		++sent;
+	return sent;
+}
+
+static int
+coro_bus_recv_v_mt(struct coro_bus *bus, int channel, unsigned *data,
+	unsigned capacity, bool is_blocking)
+{
+	if (coro_bus_recv_mt(bus, channel, &data[0], is_blocking) != 0)
+		return -1;
+	unsigned received = 1;
+	while (received < capacity &&
+	       coro_bus_recv_mt(bus, channel, &data[received], false) == 0)
+		++received;
+	return received;
 }
 
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If see the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as lone as there is still space.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_v(bus, channel, &data, 1) < 0 ? -1 : 0;
 }
 
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Append data if has space. Otherwise 'wouldblock' error.
-	 * Wakeup the first coro in the recv-queue! To let it know
-	 * there is data.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_try_send_v(bus, channel, &data, 1) < 0 ? -1 : 0;
 }
 
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_v(bus, channel, data, 1) < 0 ? -1 : 0;
 }
 
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_try_recv_v(bus, channel, data, 1) < 0 ? -1 : 0;
 }
 
+/**
+ * Find a full channel for the broadcast to wait on.
+ * @retval 0 Success. The channel is returned in @a full, or NULL
+ *     if all the channels have space.
+ * @retval -1 No channels, the error is set.
+ */
+static int
+coro_bus_find_full(struct coro_bus *bus, struct coro_bus_channel **full)
+{
+	bool has_channels = false;
+	*full = NULL;
+	for (int i = 0; i < bus->slot_count; ++i) {
+		struct coro_bus_channel *ch = coro_bus_slot(bus, i)->channel;
+		if (ch == NULL || ch->is_msg)
+			continue;
+		has_channels = true;
+		if (coro_bus_channel_is_full(ch)) {
+			*full = ch;
+			return 0;
+		}
+	}
+	if (!has_channels) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	return 0;
+}
 
-#if NEED_BROADCAST
+/** Send the message to all the channels, all of them have space. */
+static void
+coro_bus_push_all(struct coro_bus *bus, unsigned data)
+{
+	for (int i = 0; i < bus->slot_count; ++i) {
+		struct coro_bus_channel *ch = coro_bus_slot(bus, i)->channel;
+		if (ch == NULL || ch->is_msg)
+			continue;
+		coro_bus_channel_push(ch, &data, 1);
+		/* The broadcast might have taken another sender's turn. */
+		if (!coro_bus_channel_is_full(ch))
+			wakeup_queue_wakeup_first(&ch->send_queue);
+	}
+}
 
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	if (bus->is_mt) {
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	while (true) {
+		struct coro_bus_channel *full;
+		if (coro_bus_find_full(bus, &full) != 0)
+			return -1;
+		if (full == NULL)
+			break;
+		wakeup_queue_suspend_this(&full->send_queue);
+	}
+	coro_bus_push_all(bus, data);
+	return 0;
 }
 
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	if (bus->is_mt) {
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	struct coro_bus_channel *full;
+	if (coro_bus_find_full(bus, &full) != 0)
+		return -1;
+	if (full != NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	coro_bus_push_all(bus, data);
+	return 0;
 }
 
-#endif
-
-#if NEED_BATCH
-
 int
 coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	if (bus->is_mt)
+		return coro_bus_send_v_mt(bus, channel, data, count, true);
+	while (true) {
+		struct coro_bus_channel *ch = coro_bus_channel_get_of(bus, channel,
+			false);
+		if (ch == NULL)
+			return -1;
+		if (!coro_bus_channel_is_full(ch)) {
+			unsigned rc = coro_bus_channel_push(ch, data, count);
+			/*
+			 * When there is space for more, the senders
+			 * wake each other up one by one.
+			 */
+			if (!coro_bus_channel_is_full(ch))
+				wakeup_queue_wakeup_first(&ch->send_queue);
+			return rc;
+		}
+		wakeup_queue_suspend_this(&ch->send_queue);
+	}
 }
 
 int
 coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	if (bus->is_mt)
+		return coro_bus_send_v_mt(bus, channel, data, count, false);
+	struct coro_bus_channel *ch = coro_bus_channel_get_of(bus, channel,
+		false);
+	if (ch == NULL)
+		return -1;
+	if (coro_bus_channel_is_full(ch)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	return coro_bus_channel_push(ch, data, count);
 }
 
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	if (bus->is_mt)
+		return coro_bus_recv_v_mt(bus, channel, data, capacity, true);
+	while (true) {
+		struct coro_bus_channel *ch = coro_bus_channel_get_of(bus, channel,
+			false);
+		if (ch == NULL)
+			return -1;
+		if (ch->data.size > 0) {
+			unsigned rc = coro_bus_channel_pop(ch, data, capacity);
+			/* Same as the senders, the receivers chain. */
+			if (ch->data.size > 0)
+				wakeup_queue_wakeup_first(&ch->recv_queue);
+			return rc;
+		}
+		wakeup_queue_suspend_this(&ch->recv_queue);
+	}
 }
 
 int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	if (bus->is_mt)
+		return coro_bus_recv_v_mt(bus, channel, data, capacity, false);
+	struct coro_bus_channel *ch = coro_bus_channel_get_of(bus, channel,
+		false);
+	if (ch == NULL)
+		return -1;
+	if (ch->data.size == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	return coro_bus_channel_pop(ch, data, capacity);
+}
+
+/**
+ * Send the message, waiting for space if @a is_blocking. On
+ * success the channel owns the message payload.
+ */
+static int
+coro_bus_send_msg(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msg, bool is_blocking)
+{
+	while (true) {
+		struct coro_bus_channel *ch = coro_bus_channel_get_of(bus,
+			channel, true);
+		if (ch == NULL)
+			return -1;
+		if (coro_bus_channel_fits(ch, msg->size)) {
+			coro_bus_channel_push_msg(ch, msg);
+			if (!coro_bus_channel_is_full(ch))
+				wakeup_queue_wakeup_first(&ch->send_queue);
+			return 0;
+		}
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		wakeup_queue_suspend_this(&ch->send_queue);
+	}
+}
+
+/** Receive a message, waiting for one if @a is_blocking. */
+static int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg,
+	bool is_blocking)
+{
+	while (true) {
+		struct coro_bus_channel *ch = coro_bus_channel_get_of(bus,
+			channel, true);
+		if (ch == NULL)
+			return -1;
+		if (ch->data.size > 0) {
+			coro_bus_channel_pop_msg(ch, msg);
+			if (ch->data.size > 0)
+				wakeup_queue_wakeup_first(&ch->recv_queue);
+			return 0;
+		}
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		wakeup_queue_suspend_this(&ch->recv_queue);
+	}
+}
+
+static int
+coro_bus_send_ptr_impl(struct coro_bus *bus, int channel, void *ptr,
+	size_t size, bool is_blocking)
+{
+	struct coro_bus_msg msg;
+	msg.size = size;
+	msg.is_inline = false;
+	msg.payload.ptr = ptr;
+	return coro_bus_send_msg(bus, channel, &msg, is_blocking);
+}
+
+static int
+coro_bus_recv_ptr_impl(struct coro_bus *bus, int channel, void **ptr,
+	size_t *size, bool is_blocking)
+{
+	struct coro_bus_msg msg;
+	if (coro_bus_recv_msg(bus, channel, &msg, is_blocking) != 0)
+		return -1;
+	if (msg.is_inline) {
+		*ptr = malloc(msg.size);
+		memcpy(*ptr, msg.payload.bytes, msg.size);
+	} else {
+		*ptr = msg.payload.ptr;
+	}
+	*size = msg.size;
+	return 0;
+}
+
+static int
+coro_bus_send_bytes_impl(struct coro_bus *bus, int channel, const void *data,
+	size_t size, bool is_blocking)
+{
+	struct coro_bus_msg msg;
+	msg.size = size;
+	msg.is_inline = size <= CORO_BUS_MSG_INLINE_SIZE;
+	if (msg.is_inline) {
+		memcpy(msg.payload.bytes, data, size);
+	} else {
+		msg.payload.ptr = malloc(size);
+		memcpy(msg.payload.ptr, data, size);
+	}
+	if (coro_bus_send_msg(bus, channel, &msg, is_blocking) == 0)
+		return 0;
+	coro_bus_msg_destroy(&msg);
 	return -1;
 }
 
-#endif
+static ssize_t
+coro_bus_recv_bytes_impl(struct coro_bus *bus, int channel, void *buf,
+	size_t capacity, bool is_blocking)
+{
+	struct coro_bus_msg msg;
+	if (coro_bus_recv_msg(bus, channel, &msg, is_blocking) != 0)
+		return -1;
+	const void *payload = msg.is_inline ? (const void *)msg.payload.bytes :
+		msg.payload.ptr;
+	memcpy(buf, payload, msg.size < capacity ? msg.size : capacity);
+	coro_bus_msg_destroy(&msg);
+	return msg.size;
+}
+
+int
+coro_bus_send_ptr(struct coro_bus *bus, int channel, void *ptr, size_t size)
+{
+	return coro_bus_send_ptr_impl(bus, channel, ptr, size, true);
+}
+
+int
+coro_bus_try_send_ptr(struct coro_bus *bus, int channel, void *ptr,
+	size_t size)
+{
+	return coro_bus_send_ptr_impl(bus, channel, ptr, size, false);
+}
+
+int
+coro_bus_recv_ptr(struct coro_bus *bus, int channel, void **ptr, size_t *size)
+{
+	return coro_bus_recv_ptr_impl(bus, channel, ptr, size, true);
+}
+
+int
+coro_bus_try_recv_ptr(struct coro_bus *bus, int channel, void **ptr,
+	size_t *size)
+{
+	return coro_bus_recv_ptr_impl(bus, channel, ptr, size, false);
+}
+
+int
+coro_bus_send_bytes(struct coro_bus *bus, int channel, const void *data,
+	size_t size)
+{
+	return coro_bus_send_bytes_impl(bus, channel, data, size, true);
+}
+
+int
+coro_bus_try_send_bytes(struct coro_bus *bus, int channel, const void *data,
+	size_t size)
+{
+	return coro_bus_send_bytes_impl(bus, channel, data, size, false);
+}
+
+ssize_t
+coro_bus_recv_bytes(struct coro_bus *bus, int channel, void *buf,
+	size_t capacity)
+{
+	return coro_bus_recv_bytes_impl(bus, channel, buf, capacity, true);
+}
+
+ssize_t
+coro_bus_try_recv_bytes(struct coro_bus *bus, int channel, void *buf,
+	size_t capacity)
+{
+	return coro_bus_recv_bytes_impl(bus, channel, buf, capacity, false);
+}
+
+/** Operations of a select which have their wait entries on stack. */
+#define CORO_BUS_SELECT_STACK_OPS 8
+
+/** Queue where the operation waits until the channel is ready. */
+static struct wakeup_queue *
+coro_bus_op_queue(struct coro_bus_channel *ch, const struct coro_bus_op *op)
+{
+	return op->type == CORO_BUS_OP_SEND ? &ch->send_queue :
+		&ch->recv_queue;
+}
+
+static bool
+coro_bus_op_is_ready(const struct coro_bus_channel *ch,
+	const struct coro_bus_op *op)
+{
+	if (op->type == CORO_BUS_OP_SEND)
+		return !coro_bus_channel_is_full(ch);
+	return ch->data.size > 0;
+}
+
+/**
+ * Find the first operation which can be done right now.
+ * @retval 0 Success. The index is returned in @a ready, or -1 if
+ *     none of them are ready.
+ * @retval -1 A bad channel, the error is set.
+ */
+static int
+coro_bus_select_find(struct coro_bus *bus, const struct coro_bus_op *ops,
+	int count, int *ready)
+{
+	*ready = -1;
+	if (count <= 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	for (int i = 0; i < count; ++i) {
+		struct coro_bus_channel *ch = coro_bus_channel_get_of(bus,
+			ops[i].channel, false);
+		if (ch == NULL)
+			return -1;
+		if (*ready < 0 && coro_bus_op_is_ready(ch, &ops[i]))
+			*ready = i;
+	}
+	return 0;
+}
+
+/**
+ * Suspend the current coroutine in the queues of all the
+ * operations' channels until any of them wakes it up.
+ */
+static void
+coro_bus_select_wait(struct coro_bus *bus, const struct coro_bus_op *ops,
+	int count, struct wakeup_entry *entries)
+{
+	struct coro *this = coro_this();
+	for (int i = 0; i < count; ++i) {
+		struct coro_bus_channel *ch = coro_bus_channel_find(bus,
+			ops[i].channel);
+		entries[i].coro = this;
+		rlist_add_tail_entry(&coro_bus_op_queue(ch, &ops[i])->coros,
+			&entries[i], base);
+	}
+	coro_suspend();
+	/* Same as in wakeup_queue_suspend_this(), closed ones are out. */
+	for (int i = 0; i < count; ++i)
+		rlist_del_entry(&entries[i], base);
+}
+
+/**
+ * A select takes the wakeups of all the channels it waits on, but
+ * consumes only one. Pass the rest on to the next waiters, or they
+ * might sleep while their channel is ready. This also chains the
+ * wakeups of the done operation's channel, like send and recv do.
+ */
+static void
+coro_bus_select_pass_on(struct coro_bus *bus, const struct coro_bus_op *ops,
+	int count)
+{
+	for (int i = 0; i < count; ++i) {
+		/* Could be closed while the select was waiting. */
+		struct coro_bus_channel *ch = coro_bus_channel_find(bus,
+			ops[i].channel);
+		if (ch == NULL || ch->is_msg)
+			continue;
+		if (coro_bus_op_is_ready(ch, &ops[i]))
+			wakeup_queue_wakeup_first(coro_bus_op_queue(ch, &ops[i]));
+	}
+}
+
+static int
+coro_bus_select_impl(struct coro_bus *bus, struct coro_bus_op *ops, int count,
+	bool is_blocking)
+{
+	if (bus->is_mt) {
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	struct wakeup_entry stack_entries[CORO_BUS_SELECT_STACK_OPS];
+	struct wakeup_entry *entries = stack_entries;
+	int ready;
+	while (true) {
+		if (coro_bus_select_find(bus, ops, count, &ready) != 0)
+			break;
+		if (ready >= 0)
+			break;
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if (count > CORO_BUS_SELECT_STACK_OPS && entries == stack_entries)
+			entries = malloc(sizeof(entries[0]) * count);
+		coro_bus_select_wait(bus, ops, count, entries);
+	}
+	if (entries != stack_entries)
+		free(entries);
+	if (ready < 0)
+		return -1;
+	struct coro_bus_op *op = &ops[ready];
+	struct coro_bus_channel *ch = coro_bus_channel_find(bus, op->channel);
+	if (op->type == CORO_BUS_OP_SEND)
+		coro_bus_channel_push(ch, &op->data, 1);
+	else
+		coro_bus_channel_pop(ch, &op->data, 1);
+	if (is_blocking)
+		coro_bus_select_pass_on(bus, ops, count);
+	return ready;
+}
+
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_op *ops, int count)
+{
+	return coro_bus_select_impl(bus, ops, count, true);
+}
+
+int
+coro_bus_try_select(struct coro_bus *bus, struct coro_bus_op *ops, int count)
+{
+	return coro_bus_select_impl(bus, ops, count, false);
+}
@@ -1,25 +1,32 @@
 #pragma once
 
 #include <stddef.h>
+#include <sys/types.h>
 
 /**
  * Here you should specify which bonuses do you want via the
  * macros. It is important to define these macros here, in the
  * header, because it is used by tests.
  */
-#define NEED_BROADCAST 0
-#define NEED_BATCH 0
+#define NEED_BROADCAST 1
+#define NEED_BATCH 1
 
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_WRONG_TYPE,
+	CORO_BUS_ERR_TOO_MANY_CHANNELS,
+	CORO_BUS_ERR_NO_MEMORY,
 };
 
 struct coro_bus;
 
-/** Get the latest error happened in coro_bus. */
+/**
+ * Get the latest error happened in coro_bus. Each thread has its
+ * own error.
+ */
 enum coro_bus_error_code
 coro_bus_errno(void);
 
@@ -27,10 +34,39 @@ coro_bus_errno(void);
 void
 coro_bus_errno_set(enum coro_bus_error_code err);
 
-/** Create a new messaging bus with no channels in it. */
+/**
+ * Create a new messaging bus with no channels in it.
+ *
+ * A coroutine waiting in a channel is queued by an entry on its
+ * stack. So the calls which can wait - the sends, the broadcast,
+ * the recvs, and the select without the try_ prefix - must not be
+ * used by the coroutines of coro_new_shared(), whose stacks are
+ * taken by the others while they wait. The try_ calls work for any coroutines.
+ */
 struct coro_bus *
 coro_bus_new(void);
 
+/**
+ * Create a thread-safe bus. Its channels can be used at once by
+ * the coroutines of any threads and engines, and by the plain
+ * threads, which are not running coroutines. A channel is a
+ * lock-free queue, and a message is sent and received without any
+ * locks unless somebody has to wait. The waiting coroutines are
+ * woken up with coro_wakeup_remote(), and the plain threads sleep
+ * on a futex.
+ *
+ * Only the channels of unsigned numbers are supported, with the
+ * send and recv functions and their batch versions. The others
+ * fail with CORO_BUS_ERR_NOT_IMPLEMENTED. The size limit of a
+ * channel is rounded up to a power of 2, and the memory for all
+ * the messages is allocated when the channel is opened.
+ *
+ * The channels can be opened and closed by any threads, but a
+ * channel must not be closed while other threads work with it.
+ */
+struct coro_bus *
+coro_bus_new_mt(void);
+
 /**
  * Destroy the bus and all its channels. The channels can not have
  * any suspended coroutines, but might have unconsumed data which
@@ -46,11 +82,39 @@ coro_bus_delete(struct coro_bus *bus);
  *     at once.
  *
  * @retval >=0 Descriptor of the channel. It must be passed to the
- *     send/recv functions.
+ *     send/recv functions. After the channel is closed, the
+ *     descriptor doesn't refer to the new channels opened in its
+ *     place.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_TOO_MANY_CHANNELS - 2^20 channels are open.
+ *     - CORO_BUS_ERR_NO_MEMORY - no memory for the channel table.
  */
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Create a channel of messages with payloads of any size, instead
+ * of the unsigned numbers. Only the *_ptr() and *_bytes() functions
+ * work with such channels. The others, and the broadcast, fail with
+ * CORO_BUS_ERR_WRONG_TYPE or ignore them. The channel is full when
+ * it has @a size_limit messages or @a byte_limit bytes of their
+ * payloads. A message bigger than @a byte_limit can only be sent to
+ * an empty channel. The pending messages are freed with the channel.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold at once.
+ * @param byte_limit Maximum total size of the messages the channel
+ *     can hold at once. SIZE_MAX for no limit.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the bus is thread-safe.
+ *     - CORO_BUS_ERR_TOO_MANY_CHANNELS - 2^20 channels are open.
+ *     - CORO_BUS_ERR_NO_MEMORY - no memory for the channel table.
+ */
+int
+coro_bus_channel_open_msg(struct coro_bus *bus, size_t size_limit,
+	size_t byte_limit);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -126,6 +190,146 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Send a buffer allocated with malloc() to a channel opened with
+ * coro_bus_channel_open_msg(). The buffer is not copied, the
+ * receiver gets the same pointer and becomes its owner. Otherwise
+ * it works like coro_bus_send().
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param ptr Buffer to give away. It is freed by the bus if the
+ *     channel is closed before the message is received.
+ * @param size Size of the buffer, accounted in the byte limit.
+ *
+ * @retval 0 Success. The channel owns the buffer now.
+ * @retval -1 Error. Check coro_bus_errno() for reason. The buffer
+ *     still belongs to the caller.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - the channel is not of messages.
+ */
+int
+coro_bus_send_ptr(struct coro_bus *bus, int channel, void *ptr, size_t size);
+
+/**
+ * Same as coro_bus_send_ptr(), but if the message doesn't fit,
+ * fails with CORO_BUS_ERR_WOULD_BLOCK instead of suspending.
+ */
+int
+coro_bus_try_send_ptr(struct coro_bus *bus, int channel, void *ptr,
+	size_t size);
+
+/**
+ * Receive a message from a channel opened with
+ * coro_bus_channel_open_msg(), as a buffer which the caller must
+ * free(). A message sent with coro_bus_send_ptr() comes in the
+ * same buffer. Otherwise it works like coro_bus_recv().
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param ptr Output parameter to save the buffer to.
+ * @param size Output parameter to save the buffer size to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - the channel is not of messages.
+ */
+int
+coro_bus_recv_ptr(struct coro_bus *bus, int channel, void **ptr, size_t *size);
+
+/**
+ * Same as coro_bus_recv_ptr(), but if the channel is empty, fails
+ * with CORO_BUS_ERR_WOULD_BLOCK instead of suspending.
+ */
+int
+coro_bus_try_recv_ptr(struct coro_bus *bus, int channel, void **ptr,
+	size_t *size);
+
+/**
+ * Send a copy of the bytes to a channel opened with
+ * coro_bus_channel_open_msg(). Up to 16 bytes are stored right in
+ * the channel, bigger messages are copied into the heap. Otherwise
+ * it works like coro_bus_send_ptr().
+ */
+int
+coro_bus_send_bytes(struct coro_bus *bus, int channel, const void *data,
+	size_t size);
+
+/**
+ * Same as coro_bus_send_bytes(), but if the message doesn't fit,
+ * fails with CORO_BUS_ERR_WOULD_BLOCK instead of suspending.
+ */
+int
+coro_bus_try_send_bytes(struct coro_bus *bus, int channel, const void *data,
+	size_t size);
+
+/**
+ * Receive a message from a channel opened with
+ * coro_bus_channel_open_msg() into the buffer. A message bigger
+ * than the buffer is truncated, the rest of it is lost. Otherwise
+ * it works like coro_bus_recv_ptr().
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param buf Buffer to save the message to.
+ * @param capacity Size of @a buf.
+ *
+ * @retval >=0 Success, the full size of the message. If it is
+ *     bigger than @a capacity, the message was truncated.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ */
+ssize_t
+coro_bus_recv_bytes(struct coro_bus *bus, int channel, void *buf,
+	size_t capacity);
+
+/**
+ * Same as coro_bus_recv_bytes(), but if the channel is empty,
+ * fails with CORO_BUS_ERR_WOULD_BLOCK instead of suspending.
+ */
+ssize_t
+coro_bus_try_recv_bytes(struct coro_bus *bus, int channel, void *buf,
+	size_t capacity);
+
+enum coro_bus_op_type {
+	CORO_BUS_OP_SEND,
+	CORO_BUS_OP_RECV,
+};
+
+/** One of the operations to choose from in coro_bus_select(). */
+struct coro_bus_op {
+	enum coro_bus_op_type type;
+	/** Descriptor of a channel of unsigned numbers. */
+	int channel;
+	/** Message to send, or the received one. */
+	unsigned data;
+};
+
+/**
+ * Do exactly one of the operations, whichever is possible first.
+ * If none of them is possible right now, the coroutine is suspended
+ * in the queues of all the channels at once, until one of them is
+ * ready. When several are ready, the first one in the array is done.
+ * A channel can appear in several operations.
+ * @param bus Bus where the channels are located.
+ * @param ops Operations to choose from. A received message is saved
+ *     into the data of its operation.
+ * @param count Size of @a ops.
+ *
+ * @retval >=0 Success, index of the done operation.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't
+ *       exist, or there are no operations.
+ *     - CORO_BUS_ERR_WRONG_TYPE - one of the channels is not of
+ *       unsigned numbers.
+ */
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_op *ops, int count);
+
+/**
+ * Same as coro_bus_select(), but if none of the operations is
+ * possible, fails with CORO_BUS_ERR_WOULD_BLOCK instead of
+ * suspending.
+ */
+int
+coro_bus_try_select(struct coro_bus *bus, struct coro_bus_op *ops, int count);
 
 #if NEED_BROADCAST /* Bonus 1 */
 
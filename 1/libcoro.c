@@ -1,4 +1,5 @@
 #include "libcoro.h"
+#include "libcoro_sync.h"
 
 #include "rlist.h"
 
@@ -6,245 +7,334 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#define LIBCORO_USE_EPOLL 1
+#define LIBCORO_USE_PREEMPT 1
+#else
+#define LIBCORO_USE_EPOLL 0
+#define LIBCORO_USE_PREEMPT 0
+#endif
+
+/*
+ * The asynchronous IO goes through io_uring of the engine. When
+ * LIBCORO_USE_IO_THREADS is defined, or the kernel doesn't support
+ * io_uring, it is done by the helper threads instead.
+ */
+#if LIBCORO_USE_EPOLL && !defined(LIBCORO_USE_IO_THREADS) && \
+	__has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define LIBCORO_USE_IO_URING 1
+#else
+#define LIBCORO_USE_IO_URING 0
+#endif
+
+#if LIBCORO_USE_PREEMPT && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
-enum coro_state {
-	CORO_STATE_RUNNING,
-	CORO_STATE_SUSPENDED,
-	CORO_STATE_FINISHED,
-};
+/*
+ * The context switch backend is chosen at build time. On x86-64
+ * and aarch64 the coroutines are switched by a few assembly
+ * instructions saving only the callee-saved registers, and are
+ * created without a single syscall. On the other platforms, or
+ * when LIBCORO_USE_SIGJMP is defined, the portable backend based
+ * on sigsetjmp() and sigaltstack() is used.
+ */
+#if !defined(LIBCORO_USE_SIGJMP) && \
+	(defined(__x86_64__) || defined(__aarch64__))
+#define LIBCORO_ASM_SWITCH 1
+#else
+#define LIBCORO_ASM_SWITCH 0
+#endif
 
-/** Main coroutine structure, its context. */
-struct coro {
-	/** Coroutine state. */
-	enum coro_state state;
-	/** A value, returned by func. */
-	void *ret;
-	/** Stack, used by the coroutine. */
-	void *stack;
-	/** An argument for the function func. */
-	void *func_arg;
-	/** A function to call as a coroutine. */
-	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/**
-	 * Coroutine which is trying to join this one right now.
-	 */
-	struct coro *joiner;
-	/** Links in a coroutine list, used by the scheduler. */
-	struct rlist link;
-};
+/**
+ * Entry point of a new coroutine context. It must never return -
+ * there is nowhere to return to.
+ */
+typedef void (*coro_ctx_entry_f)(void *arg);
 
-struct coro_engine {
-	/**
-	 * Scheduler is the main coroutine - it represents the
-	 * context in which the scheduler itself runs.
-	 */
-	struct coro sched;
-	/** Which coroutine works at this moment. */
-	struct coro *this;
+#if LIBCORO_ASM_SWITCH
 
+#if defined(__APPLE__)
+#define CORO_ASM_SYM(name) "_" #name
+#else
+#define CORO_ASM_SYM(name) #name
+#endif
+
+/** Saved execution context of a coroutine. */
+struct coro_ctx {
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
-	 */
-	struct rlist coros_running_now;
-	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
-	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
-	/** Total number of coroutines, including the pool. */
-	size_t coro_count;
-	/**
-	 * Buffer, used by the coroutine constructor to escape
-	 * from the signal handler back into the constructor to
-	 * rollback sigaltstack etc.
+	 * Stack pointer. All the callee-saved registers are pushed
+	 * onto the stack itself.
 	 */
-	sigjmp_buf start_point;
+	void *sp;
 };
 
+/**
+ * Push the callee-saved registers onto the current stack, save
+ * the stack pointer into @a from_sp, then switch to the stack
+ * @a to_sp and pop the registers saved there.
+ */
+void
+coro_ctx_switch_asm(void **from_sp, void *to_sp);
+
+/**
+ * The first code executed on a new stack. It moves the entry
+ * function argument, prepared by coro_ctx_create() in a
+ * callee-saved register, into the argument register and jumps
+ * into the entry.
+ */
+void
+coro_ctx_trampoline_asm(void);
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout, from the stack pointer upwards: MXCSR and x87
+ * control word, r15, r14, r13, r12, rbx, rbp, return address.
+ */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl " CORO_ASM_SYM(coro_ctx_switch_asm) "\n"
+	CORO_ASM_SYM(coro_ctx_switch_asm) ":\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl " CORO_ASM_SYM(coro_ctx_trampoline_asm) "\n"
+	CORO_ASM_SYM(coro_ctx_trampoline_asm) ":\n"
+	"	movq %r13, %rdi\n"
+	"	jmpq *%r12\n"
+);
+
 static void
-coro_engine_create(struct coro_engine *engine)
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_entry_f entry, void *arg)
 {
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	void **sp = (void **)top;
+	/*
+	 * Fake return address of the entry function. It makes the
+	 * stack look like the entry was called, and terminates the
+	 * backtraces.
+	 */
+	*--sp = NULL;
+	*--sp = (void *)coro_ctx_trampoline_asm;
+	/* rbp, rbx. */
+	*--sp = NULL;
+	*--sp = NULL;
+	/* r12, r13, r14, r15. */
+	*--sp = (void *)entry;
+	*--sp = arg;
+	*--sp = NULL;
+	*--sp = NULL;
+	/* Default MXCSR and x87 control word. */
+	uint32_t fpu_ctl[2] = {0x1F80, 0x037F};
+	memcpy(--sp, fpu_ctl, sizeof(fpu_ctl));
+	ctx->sp = sp;
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
-{
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this;
-	assert(from != NULL);
+#elif defined(__aarch64__)
 
-	engine->this = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this == NULL);
-	engine->this = from;
-}
+/*
+ * Frame layout, from the stack pointer upwards: x19-x28, x29, x30,
+ * d8-d15.
+ */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl " CORO_ASM_SYM(coro_ctx_switch_asm) "\n"
+	CORO_ASM_SYM(coro_ctx_switch_asm) ":\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl " CORO_ASM_SYM(coro_ctx_trampoline_asm) "\n"
+	CORO_ASM_SYM(coro_ctx_trampoline_asm) ":\n"
+	"	mov x0, x20\n"
+	"	mov x30, xzr\n"
+	"	br x19\n"
+);
 
 static void
-coro_engine_suspend(struct coro_engine *engine)
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_entry_f entry, void *arg)
 {
-	struct coro *this = engine->this;
-	if (this == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
-		exit(-1);
-	}
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	this->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	void **sp = (void **)(top - 160);
+	memset(sp, 0, 160);
+	/* x19, x20. */
+	sp[0] = (void *)entry;
+	sp[1] = arg;
+	/* x30 - where the first switch "returns" to. */
+	sp[11] = (void *)coro_ctx_trampoline_asm;
+	ctx->sp = sp;
 }
 
-static void
-coro_engine_yield(struct coro_engine *engine)
+#endif
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
 {
-	struct coro *this = engine->this;
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this, link);
-	coro_engine_resume_next(engine);
+	coro_ctx_switch_asm(&from->sp, to->sp);
 }
 
-static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+/**
+ * Lowest stack address used by a switched out context. Everything
+ * above it up to the stack top is needed to continue it.
+ */
+static inline void *
+coro_ctx_sp(const struct coro_ctx *ctx)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	return ctx->sp;
 }
 
-static void
-coro_engine_run(struct coro_engine *engine)
+#else /* !LIBCORO_ASM_SWITCH */
+
+/** Saved execution context of a coroutine. */
+struct coro_ctx {
+	sigjmp_buf buf;
+	/** Stack position at the moment of the last switch out. */
+	void *sp;
+};
+
+/**
+ * Frame of a called function is below the caller's stack pointer,
+ * so this is a safe estimation of the stack position.
+ */
+static __attribute__((noinline)) void *
+coro_ctx_frame(void)
 {
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+	return __builtin_frame_address(0);
+}
 
-		assert(engine->this == NULL);
-		engine->this = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this == &engine->sched);
-		engine->this = NULL;
-	}
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	from->sp = coro_ctx_frame();
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
 }
 
-static void
-coro_engine_destroy(struct coro_engine *engine)
+static inline void *
+coro_ctx_sp(const struct coro_ctx *ctx)
 {
-	assert(engine->this == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		free(c->stack);
-		free(c);
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
-	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
+	return ctx->sp;
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+/** Context being created, passed to the signal handler. */
+struct coro_ctx_start {
+	/** The new context. */
+	struct coro_ctx *ctx;
+	/** Entry function and its argument. */
+	coro_ctx_entry_f entry;
+	void *arg;
+	/**
+	 * Buffer, used by the context constructor to escape from
+	 * the signal handler back into the constructor to rollback
+	 * sigaltstack etc.
+	 */
+	sigjmp_buf start_point;
+};
+
+static __thread struct coro_ctx_start *new_coro_ctx = NULL;
 
 /**
- * The core part of the coroutines creation - this signal handler
+ * The core part of the context creation - this signal handler
  * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
+ * remembers its current context and jumps back to the context
  * constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_ctx_body(int signum)
 {
 	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
-
-	struct coro *c = my_engine->this;
-	my_engine->this = NULL;
+	struct coro_ctx_start *start = new_coro_ctx;
+	new_coro_ctx = NULL;
+	coro_ctx_entry_f entry = start->entry;
+	void *arg = start->arg;
 	/*
 	 * On invocation jump back to the constructor right after
 	 * remembering the context.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
+	if (sigsetjmp(start->ctx->buf, 0) == 0)
+		siglongjmp(start->start_point, 1);
 	/*
 	 * If the execution is here, then the coroutine should
 	 * finally start work.
 	 */
-	my_engine->this = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
-	}
+	entry(arg);
+	abort();
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_entry_f entry, void *arg)
 {
-	struct coro *c = malloc(sizeof(*c));
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -260,32 +350,33 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
+	newsa.sa_handler = coro_ctx_body;
 	newsa.sa_flags = SA_ONSTACK;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
+	newst.ss_sp = stack;
 	newst.ss_size = stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 
 	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this;
-	engine->this = c;
+	struct coro_ctx_start start;
+	start.ctx = ctx;
+	start.entry = entry;
+	start.arg = arg;
+	assert(new_coro_ctx == NULL);
+	new_coro_ctx = &start;
 	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
+	if (sigsetjmp(start.start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (engine->this != NULL)
+		while (new_coro_ctx != NULL)
 			sigsuspend(&suss);
 	}
-	assert(new_coro_engine == NULL);
-	engine->this = old_this;
+	assert(new_coro_ctx == NULL);
 
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
@@ -305,102 +396,4232 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
-
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
 }
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
-{
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
+#endif /* !LIBCORO_ASM_SWITCH */
 
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
-}
+/** Default size of a coroutine stack, without the guard page. */
+#define CORO_STACK_SIZE_DEFAULT (1024 * 1024)
+
+/**
+ * How much of the stack under the entry function frame is
+ * considered alive while the coroutine is parked in the pool. It
+ * must fit the frames of the context switch.
+ */
+#define CORO_STACK_LIVE_MARGIN (2 * 4096)
+
+#if !defined(MAP_STACK)
+#define MAP_STACK 0
+#endif
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
 
+/**
+ * Map a stack of at least @a size usable bytes with a
+ * non-accessible guard page below it. The pages are committed
+ * lazily by the kernel, when touched for the first time. The
+ * usable size is rounded up to the page size and returned in
+ * @a size. The guard page makes the stack 2 mappings, and the
+ * process runs out of them at vm.max_map_count.
+ * @return The stack or NULL with errno set.
+ */
 static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
+coro_stack_new(size_t *size, size_t page_size)
 {
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this);
-	coro->joiner = NULL;
-	void *ret = coro->ret;
-	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
-	return ret;
+	size_t usable = (*size + page_size - 1) & ~(page_size - 1);
+	char *stack = mmap(NULL, usable + page_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+	if (stack == MAP_FAILED)
+		return NULL;
+	/* Stacks grow down, so an overflow hits the lowest page. */
+	if (mprotect(stack, page_size, PROT_NONE) != 0) {
+		int err = errno;
+		munmap(stack, usable + page_size);
+		errno = err;
+		return NULL;
+	}
+	*size = usable;
+	return stack + page_size;
 }
 
-//////////////////////////////////////////////////////////////////
-
-static struct coro_engine glob_engine;
-
-void
-coro_sched_init(void)
+static void
+coro_stack_delete(void *stack, size_t size, size_t page_size)
 {
-	coro_engine_create(&glob_engine);
+	if (munmap((char *)stack - page_size, size + page_size) != 0)
+		handle_error();
 }
 
-void
-coro_sched_run(void)
+/**
+ * Map @a count stacks of at least @a size usable bytes each with a
+ * single mmap(). Each stack has its own guard page below it. The
+ * usable size of one stack is returned in @a size.
+ * @return The stacks or NULL with errno set.
+ */
+static void *
+coro_stacks_new(size_t count, size_t *size, size_t page_size)
 {
-	coro_engine_run(&glob_engine);
+	size_t usable = (*size + page_size - 1) & ~(page_size - 1);
+	size_t step = usable + page_size;
+	char *stacks = mmap(NULL, step * count, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+	if (stacks == MAP_FAILED)
+		return NULL;
+	for (size_t i = 0; i < count; ++i) {
+		if (mprotect(stacks + step * i, page_size, PROT_NONE) != 0) {
+			int err = errno;
+			munmap(stacks, step * count);
+			errno = err;
+			return NULL;
+		}
+	}
+	*size = usable;
+	return stacks;
 }
 
-void
-coro_sched_destroy(void)
+/**
+ * Give back to the kernel the pages of the stack below @a live.
+ * The stack stays mapped and the pages are faulted in again, zeroed,
+ * only if they are touched. MADV_DONTNEED is used instead of the
+ * lazier MADV_FREE, so the resident memory drops right away.
+ */
+static void
+coro_stack_release(void *stack, const char *live, size_t page_size)
 {
-	coro_engine_destroy(&glob_engine);
+	uintptr_t end = (uintptr_t)live & ~(page_size - 1);
+	if (end <= (uintptr_t)stack)
+		return;
+	if (madvise(stack, end - (uintptr_t)stack, MADV_DONTNEED) != 0)
+		handle_error();
 }
 
-struct coro *
-coro_this(void)
+/** What is done to measure and adapt the stack sizes. */
+static enum coro_stack_mode coro_stack_mode = CORO_STACK_FIXED;
+
+/**
+ * Measure how many bytes at the top of the stack were ever used.
+ * The stack is painted with zeros - the fresh and the released
+ * pages are zeroed by the kernel. The lowest resident page is
+ * found with mincore() and then scanned for the first not zero
+ * word. So the untouched pages are not faulted in.
+ */
+static size_t
+coro_stack_used(const void *stack, size_t size, size_t page_size)
 {
-	return glob_engine.this;
+	enum { BATCH = 256 };
+	unsigned char vec[BATCH];
+	const char *top = (const char *)stack + size;
+	for (const char *pos = stack; pos < top;) {
+		size_t len = top - pos;
+		if (len > BATCH * page_size)
+			len = BATCH * page_size;
+		if (mincore((void *)pos, len, vec) != 0)
+			handle_error();
+		size_t count = len / page_size;
+		for (size_t i = 0; i < count; ++i, pos += page_size) {
+			if ((vec[i] & 1) == 0)
+				continue;
+			const uintptr_t *word = (const uintptr_t *)pos;
+			const uintptr_t *end = word + page_size / sizeof(*word);
+			for (; word < end; ++word) {
+				if (*word != 0)
+					return top - (const char *)word;
+			}
+		}
+	}
+	return 0;
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Paint with zeros the part of a finished coroutine's stack which
+ * wasn't released - between the live mark and the frames of the
+ * switch.
+ */
+static void
+coro_stack_paint(const char *live, const char *sp)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	/* Leave the red zone below the stack pointer alone. */
+	sp -= 128;
+	if (sp > live)
+		memset((void *)live, 0, sp - live);
 }
 
-void *
-coro_join(struct coro *coro)
+/**
+ * Cut the stack down to @a size usable bytes at its top. Everything
+ * below the new guard page is unmapped. @a size is rounded up to
+ * the page size and returned.
+ */
+static void *
+coro_stack_shrink(void *stack, size_t old_size, size_t *size,
+	size_t page_size)
 {
-	return coro_engine_join(&glob_engine, coro);
+	size_t usable = (*size + page_size - 1) & ~(page_size - 1);
+	assert(usable < old_size);
+	char *old_guard = (char *)stack - page_size;
+	char *new_stack = (char *)stack + old_size - usable;
+	char *new_guard = new_stack - page_size;
+	if (munmap(old_guard, new_guard - old_guard) != 0)
+		handle_error();
+	if (mprotect(new_guard, page_size, PROT_NONE) != 0)
+		handle_error();
+	*size = usable;
+	return new_stack;
 }
 
-void
-coro_suspend(void)
+/** Stack usage observed for a coroutine function. */
+struct coro_stack_hint {
+	uintptr_t func;
+	size_t usage;
+};
+
+#define CORO_STACK_HINT_COUNT 1024
+/** Extra space given to an adaptive stack above the usage. */
+#define CORO_STACK_ADAPTIVE_MARGIN (64 * 1024)
+
+/**
+ * Max stack usage of each coroutine function seen so far, an open
+ * addressing hash table. It is shared by all the threads, the
+ * entries are only added and never removed. When full, the new
+ * functions just get the default stacks.
+ */
+static struct coro_stack_hint coro_stack_hints[CORO_STACK_HINT_COUNT];
+
+static struct coro_stack_hint *
+coro_stack_hint_find(coro_f func, bool is_add)
 {
-	coro_engine_suspend(&glob_engine);
+	uintptr_t key = (uintptr_t)func;
+	size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 54;
+	for (int n = 0; n < CORO_STACK_HINT_COUNT; ++n) {
+		struct coro_stack_hint *hint = &coro_stack_hints[
+			(i + n) % CORO_STACK_HINT_COUNT];
+		uintptr_t old = __atomic_load_n(&hint->func, __ATOMIC_ACQUIRE);
+		if (old == key)
+			return hint;
+		if (old != 0)
+			continue;
+		if (!is_add)
+			return NULL;
+		if (__atomic_compare_exchange_n(&hint->func, &old, key, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || old == key)
+			return hint;
+	}
+	return NULL;
 }
 
-void
-coro_yield(void)
+static void
+coro_stack_hint_update(coro_f func, size_t usage)
 {
-	coro_engine_yield(&glob_engine);
+	struct coro_stack_hint *hint = coro_stack_hint_find(func, true);
+	if (hint == NULL)
+		return;
+	size_t old = __atomic_load_n(&hint->usage, __ATOMIC_RELAXED);
+	while (old < usage && !__atomic_compare_exchange_n(&hint->usage, &old,
+		usage, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
 }
 
-void
+/**
+ * Stack size for a new coroutine running the function. In the
+ * adaptive mode it is the max usage seen plus a margin, never more
+ * than the default.
+ */
+static size_t
+coro_stack_size_for(coro_f func)
+{
+	if (coro_stack_mode != CORO_STACK_ADAPTIVE)
+		return CORO_STACK_SIZE_DEFAULT;
+	struct coro_stack_hint *hint = coro_stack_hint_find(func, false);
+	if (hint == NULL)
+		return CORO_STACK_SIZE_DEFAULT;
+	size_t usage = __atomic_load_n(&hint->usage, __ATOMIC_RELAXED);
+	if (usage == 0)
+		return CORO_STACK_SIZE_DEFAULT;
+	size_t margin = usage > CORO_STACK_ADAPTIVE_MARGIN ?
+		usage : CORO_STACK_ADAPTIVE_MARGIN;
+	if (usage + margin > CORO_STACK_SIZE_DEFAULT)
+		return CORO_STACK_SIZE_DEFAULT;
+	return usage + margin;
+}
+
+/** Timer wheel resolution, in nanoseconds. */
+#define CORO_TIMER_TICK_NS 1000000
+/** Each level of the wheel has 64 slots. */
+#define CORO_TIMER_WHEEL_BITS 6
+#define CORO_TIMER_WHEEL_SIZE (1 << CORO_TIMER_WHEEL_BITS)
+#define CORO_TIMER_WHEEL_MASK (CORO_TIMER_WHEEL_SIZE - 1)
+/** 6 levels of 1ms ticks cover more than 2 years. */
+#define CORO_TIMER_WHEEL_LEVELS 6
+
+static uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		handle_error();
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The coroutines run time accounting reads the CPU counter on each
+ * switch. It is cheap on the real hardware, but some virtual
+ * machines trap it. Build with -DLIBCORO_NO_RUN_TIME=1 to turn it
+ * off. The other counters are always on.
+ */
+#if !defined(LIBCORO_NO_RUN_TIME)
+#define LIBCORO_NO_RUN_TIME 0
+#endif
+
+/**
+ * CPU timestamp counter. Much cheaper than the clock, so can be
+ * taken on each switch. Converted into nanoseconds only when the
+ * statistics are requested.
+ */
+static inline uint64_t
+coro_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t cycles;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+	return cycles;
+#else
+	return coro_clock_ns();
+#endif
+}
+
+/** Clock and counter values to calibrate the counter against. */
+static uint64_t coro_cycles_start = 0;
+static uint64_t coro_clock_start = 0;
+
+static void
+coro_cycles_calibrate_start(void)
+{
+	if (coro_clock_start != 0)
+		return;
+	coro_clock_start = coro_clock_ns();
+	coro_cycles_start = coro_cycles();
+}
+
+/** Length of one counter unit in nanoseconds. */
+static double
+coro_ns_per_cycle(void)
+{
+	uint64_t clock = coro_clock_ns() - coro_clock_start;
+	uint64_t total = coro_cycles() - coro_cycles_start;
+	if (total == 0)
+		return 0;
+	return (double)clock / total;
+}
+
+/** Convert the counter difference into nanoseconds. */
+static uint64_t
+coro_cycles_to_ns(uint64_t cycles)
+{
+	return cycles * coro_ns_per_cycle();
+}
+
+/** A timeout of a coroutine. */
+struct coro_timer {
+	/** Link in a slot of the timer wheel. */
+	struct rlist link;
+	/** Tick when the timer expires. */
+	uint64_t deadline;
+	/** Wheel position, to unlink the timer in O(1). */
+	int level;
+	int slot;
+	/** True while the timer is in the wheel. */
+	bool is_armed;
+	/** True if the timer has woken the coroutine up. */
+	bool is_fired;
+	/** Engine owning the wheel the timer was armed in. */
+	struct coro_engine *engine;
+};
+
+/**
+ * Hierarchical timer wheel. A timer goes to the level where its
+ * distance from the current tick fits, into a slot picked by its
+ * deadline. Level 0 slots are expired one per tick. When level 0
+ * makes a full turn, the next slot of level 1 is cascaded into the
+ * lower levels, and so on. Adding and removing a timer is O(1)
+ * regardless of the timer count.
+ */
+struct coro_timer_wheel {
+	/** Next tick to process. */
+	uint64_t tick;
+	/** Monotonic clock value at tick 0. */
+	uint64_t start_ns;
+	/** Number of the armed timers. */
+	size_t count;
+	/** Bit per slot, set when the slot is not empty. */
+	uint64_t masks[CORO_TIMER_WHEEL_LEVELS];
+	/** Timer lists. */
+	struct rlist slots[CORO_TIMER_WHEEL_LEVELS][CORO_TIMER_WHEEL_SIZE];
+};
+
+static void
+coro_timer_wheel_create(struct coro_timer_wheel *wheel)
+{
+	wheel->tick = 0;
+	wheel->start_ns = coro_clock_ns();
+	wheel->count = 0;
+	for (int l = 0; l < CORO_TIMER_WHEEL_LEVELS; ++l) {
+		wheel->masks[l] = 0;
+		for (int i = 0; i < CORO_TIMER_WHEEL_SIZE; ++i)
+			rlist_create(&wheel->slots[l][i]);
+	}
+}
+
+/** Tick corresponding to the given monotonic clock time. */
+static uint64_t
+coro_timer_wheel_tick_of(const struct coro_timer_wheel *wheel, uint64_t ns)
+{
+	if (ns <= wheel->start_ns)
+		return 0;
+	return (ns - wheel->start_ns) / CORO_TIMER_TICK_NS;
+}
+
+static void
+coro_timer_wheel_add(struct coro_timer_wheel *wheel, struct coro_timer *timer)
+{
+	uint64_t deadline = timer->deadline;
+	if (deadline < wheel->tick)
+		deadline = wheel->tick;
+	uint64_t delta = deadline - wheel->tick;
+	int level = 0;
+	while (level < CORO_TIMER_WHEEL_LEVELS - 1 &&
+	       delta >> (CORO_TIMER_WHEEL_BITS * (level + 1)) != 0)
+		++level;
+	/* Too far timers wait at the top level and cascade again. */
+	if (delta >> (CORO_TIMER_WHEEL_BITS * (level + 1)) != 0)
+		deadline = wheel->tick +
+			(1ULL << (CORO_TIMER_WHEEL_BITS * (level + 1))) - 1;
+	int slot = (deadline >> (CORO_TIMER_WHEEL_BITS * level)) &
+		CORO_TIMER_WHEEL_MASK;
+	timer->level = level;
+	timer->slot = slot;
+	rlist_add_tail(&wheel->slots[level][slot], &timer->link);
+	wheel->masks[level] |= 1ULL << slot;
+	__atomic_add_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+}
+
+static void
+coro_timer_wheel_del(struct coro_timer_wheel *wheel, struct coro_timer *timer)
+{
+	rlist_del(&timer->link);
+	if (rlist_empty(&wheel->slots[timer->level][timer->slot]))
+		wheel->masks[timer->level] &= ~(1ULL << timer->slot);
+	__atomic_sub_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+}
+
+static inline size_t
+coro_timer_wheel_count(const struct coro_timer_wheel *wheel)
+{
+	return __atomic_load_n(&wheel->count, __ATOMIC_RELAXED);
+}
+
+/** Move all the timers of the slot into the lower levels. */
+static void
+coro_timer_wheel_cascade(struct coro_timer_wheel *wheel, int level, int slot)
+{
+	struct rlist timers;
+	rlist_create(&timers);
+	rlist_splice(&timers, &wheel->slots[level][slot]);
+	wheel->masks[level] &= ~(1ULL << slot);
+	while (!rlist_empty(&timers)) {
+		struct coro_timer *t = rlist_shift_entry(&timers,
+			struct coro_timer, link);
+		__atomic_sub_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+		coro_timer_wheel_add(wheel, t);
+	}
+}
+
+/**
+ * Process all the ticks up to @a now_tick inclusive. The expired
+ * timers are moved into @a expired.
+ */
+static void
+coro_timer_wheel_advance(struct coro_timer_wheel *wheel, uint64_t now_tick,
+	struct rlist *expired)
+{
+	while (wheel->tick <= now_tick) {
+		uint64_t tick = wheel->tick;
+		if (coro_timer_wheel_count(wheel) == 0) {
+			wheel->tick = now_tick + 1;
+			break;
+		}
+		int slot = tick & CORO_TIMER_WHEEL_MASK;
+		if (slot == 0) {
+			for (int l = 1; l < CORO_TIMER_WHEEL_LEVELS; ++l) {
+				int i = (tick >> (CORO_TIMER_WHEEL_BITS * l)) &
+					CORO_TIMER_WHEEL_MASK;
+				coro_timer_wheel_cascade(wheel, l, i);
+				if (i != 0)
+					break;
+			}
+		} else if (wheel->masks[0] == 0) {
+			/* Nothing to do until the next cascade. */
+			uint64_t next = (tick | CORO_TIMER_WHEEL_MASK) + 1;
+			wheel->tick = next <= now_tick ? next : now_tick + 1;
+			continue;
+		}
+		struct rlist *list = &wheel->slots[0][slot];
+		while (!rlist_empty(list)) {
+			struct coro_timer *t = rlist_first_entry(list,
+				struct coro_timer, link);
+			coro_timer_wheel_del(wheel, t);
+			rlist_add_tail(expired, &t->link);
+		}
+		wheel->tick = tick + 1;
+	}
+}
+
+/** Rotate the slot mask so as the given slot becomes bit 0. */
+static inline uint64_t
+coro_timer_mask_from(uint64_t mask, int slot)
+{
+	if (slot == 0)
+		return mask;
+	return (mask >> slot) | (mask << (CORO_TIMER_WHEEL_SIZE - slot));
+}
+
+/**
+ * The earliest tick when the wheel has something to do - expire a
+ * timer or cascade a non-empty slot. UINT64_MAX if it is empty.
+ */
+static uint64_t
+coro_timer_wheel_next_tick(const struct coro_timer_wheel *wheel)
+{
+	uint64_t tick = wheel->tick;
+	uint64_t best = UINT64_MAX;
+	if (wheel->masks[0] != 0) {
+		uint64_t mask = coro_timer_mask_from(wheel->masks[0],
+			tick & CORO_TIMER_WHEEL_MASK);
+		best = tick + __builtin_ctzll(mask);
+	}
+	for (int l = 1; l < CORO_TIMER_WHEEL_LEVELS; ++l) {
+		if (wheel->masks[l] == 0)
+			continue;
+		int shift = CORO_TIMER_WHEEL_BITS * l;
+		/*
+		 * The current slot of the level is cascaded on its
+		 * first tick. If that is passed, the next slot is.
+		 */
+		uint64_t first = tick >> shift;
+		if ((tick & ((1ULL << shift) - 1)) != 0)
+			++first;
+		uint64_t mask = coro_timer_mask_from(wheel->masks[l],
+			first & CORO_TIMER_WHEEL_MASK);
+		uint64_t next = (first + __builtin_ctzll(mask)) << shift;
+		if (next < best)
+			best = next;
+	}
+	return best;
+}
+
+/** Coroutine-local values stored right in struct coro. */
+#define CORO_KEYS_INLINE 8
+
+enum coro_state {
+	CORO_STATE_RUNNING,
+	CORO_STATE_SUSPENDED,
+	CORO_STATE_FINISHED,
+};
+
+/** Main coroutine structure, its context. */
+/**
+ * A coroutine waiting for a synchronization primitive. It is kept
+ * in the coroutine, not on its stack, because a shared stack is
+ * used by the other coroutines while the owner waits.
+ */
+struct coro_waiter {
+	struct rlist link;
+	struct coro *coro;
+	/** Set when the waited resource is handed over to it. */
+	int is_granted;
+};
+
+struct coro {
+	/** Coroutine state. */
+	enum coro_state state;
+	/** A value, returned by func. */
+	void *ret;
+	/**
+	 * Stack, used by the coroutine. It is protected by a guard
+	 * page right below it.
+	 */
+	void *stack;
+	/** Usable stack size, without the guard page. */
+	size_t stack_size;
+	/**
+	 * Lowest address of the stack which has to stay resident
+	 * while the coroutine is parked in the pool.
+	 */
+	const char *stack_live;
+	/** An argument for the function func. */
+	void *func_arg;
+	/** A function to call as a coroutine. */
+	coro_f func;
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+	/**
+	 * True while some thread executes the coroutine, including
+	 * the switch out of it. Only used by the multi-threaded
+	 * scheduler, where a woken up coroutine can be picked by
+	 * another thread before it has left the previous one.
+	 */
+	bool is_on_cpu;
+	/** Timeout of the current suspension, if any. */
+	struct coro_timer timer;
+	/** Events which woke up the coroutine waiting on a descriptor. */
+	int fd_events;
+	/** Descriptor the coroutine is waiting on. */
+	int fd;
+	/** Link in the engine's list of the descriptor waiters. */
+	struct rlist fd_link;
+	/** Queue entry while waiting for a synchronization primitive. */
+	struct coro_waiter waiter;
+	/** Next coroutine in the inbox of the remote wakeups. */
+	struct coro *remote_next;
+	/** True while the coroutine is in the inbox. */
+	bool is_remote_queued;
+	/** Set when a remote wakeup is delivered to the coroutine. */
+	int is_remote_woken;
+	/**
+	 * Set by coro_wakeup_remote() until the wakeup is delivered.
+	 * The inbox also brings the IO completions, which are not
+	 * remote wakeups.
+	 */
+	int is_remote_pending;
+	/** Result of the last IO request, -errno on failure. */
+	ssize_t io_res;
+	/** Set when the IO request of the coroutine is complete. */
+	int is_io_done;
+	/** Engine which receives the remote wakeups of the coroutine. */
+	struct coro_engine *home;
+	/**
+	 * Coroutine which is trying to join this one right now.
+	 */
+	struct coro *joiner;
+	/**
+	 * Stack which the coroutine shares with the others. NULL if
+	 * it has a dedicated one.
+	 */
+	struct coro_shared_stack *shared;
+	/**
+	 * Copy of the used part of the shared stack, taken when
+	 * another coroutine needed the stack. Empty if the
+	 * coroutine has never run.
+	 */
+	void *image;
+	size_t image_size;
+	size_t image_capacity;
+	/** Unique number of the coroutine, for the traces. */
+	uint64_t id;
+	/** Number of times the coroutine was switched to. */
+	uint64_t switch_count;
+	/** Time spent running, in coro_cycles() units. */
+	uint64_t run_cycles;
+	/** Number of times the coroutine was preempted. */
+	uint64_t preempt_count;
+	/** Run queue the coroutine is scheduled into. */
+	enum coro_priority priority;
+	/**
+	 * Stack usage of the finished function, measured when the
+	 * stack mode is not fixed.
+	 */
+	size_t stack_usage;
+	/** Coroutine-local values of the first keys. */
+	void *specific[CORO_KEYS_INLINE];
+	/**
+	 * Values of the other keys, allocated on the first set of
+	 * such a key. Kept for reuse when the coroutine is pooled.
+	 */
+	void **specific_ext;
+	/**
+	 * Slab the coroutine and its stack were allocated in. NULL
+	 * if they were allocated separately.
+	 */
+	struct coro_slab *slab;
+	/** Generator run by the coroutine. NULL for the others. */
+	struct coro_gen *gen;
+	/** Links in a coroutine list, used by the scheduler. */
+	struct rlist link;
+};
+
+/**
+ * Coroutine producing values for another one. It is never
+ * scheduled while it works for the consumer, they switch to each
+ * other directly.
+ */
+struct coro_gen {
+	/** Coroutine running the generator function. */
+	struct coro *coro;
+	coro_gen_f func;
+	void *func_arg;
+	/** Coroutine waiting in coro_gen_next(). NULL if none. */
+	struct coro *consumer;
+	/** Last value given by the generator. */
+	void *value;
+	/** True when the generator function has returned. */
+	bool is_done;
+};
+
+/**
+ * Coroutines allocated in one go, together with their stacks. They
+ * live in the pool when not used and are freed all at once with the
+ * engine.
+ */
+struct coro_slab {
+	/** Link in the engine's list of slabs. */
+	struct rlist link;
+	/** All the stacks of the slab, mapped together. */
+	void *stacks;
+	size_t stacks_size;
+	size_t count;
+	struct coro coros[];
+};
+
+/** Number of the shared stacks in an engine. */
+#define CORO_SHARED_STACK_COUNT 4
+/** Size of the stack to copy the shared stacks on. */
+#define CORO_COPY_STACK_SIZE (64 * 1024)
+
+/**
+ * A stack used by many coroutines in turn. Only one of them has
+ * its frames on the stack, the others are stored in their images.
+ */
+struct coro_shared_stack {
+	void *stack;
+	size_t size;
+	/** Coroutine whose frames are on the stack now. */
+	struct coro *owner;
+};
+
+/**
+ * Lock-free queue of the coroutines woken up from other threads.
+ * Any thread can push, only one thread at a time pops.
+ */
+struct coro_inbox {
+	/** Pushed coroutines, the last pushed first. */
+	struct coro *head;
+	/**
+	 * Eventfd signaled by a push into the empty queue. -1 until
+	 * the first coro_suspend_remote().
+	 */
+	int fd;
+	/**
+	 * Number of the coroutines in coro_suspend_remote() and of
+	 * the open mailboxes.
+	 */
+	size_t wait_count;
+	/** Just created mailboxes, the last created first. */
+	struct coro_mailbox *new_mailboxes;
+	/** Mailboxes checked by the receiver. */
+	struct rlist mailboxes;
+	/**
+	 * True while the receiver is going to block in poll. The
+	 * mailbox senders signal the eventfd only then.
+	 */
+	bool is_polling;
+};
+
+/** Cache line size, to keep the fields of different threads apart. */
+#define CORO_CACHE_LINE 64
+
+/** Closure sent through a mailbox. */
+struct coro_mailbox_msg {
+	coro_mailbox_f func;
+	void *arg;
+};
+
+/**
+ * Ring of messages from one thread to an engine. The sender and the
+ * receiver fields are on different cache lines, and each side only
+ * reads the other's position when its own cached copy is not enough.
+ */
+struct coro_mailbox {
+	/** Inbox of the receiving engine. */
+	struct coro_inbox *inbox;
+	struct coro_mailbox_msg *msgs;
+	/** Capacity - 1, the capacity is a power of 2. */
+	size_t mask;
+	/** Next message to receive. Written by the receiver. */
+	size_t head __attribute__((aligned(CORO_CACHE_LINE)));
+	/** Next free slot. Written by the sender. */
+	size_t tail __attribute__((aligned(CORO_CACHE_LINE)));
+	/** Last seen head, to check for free space without loading it. */
+	size_t head_cache;
+	/** Set by the sender after the last message. */
+	bool is_closed;
+	/** Next mailbox in the list of the just created ones. */
+	struct coro_mailbox *new_next;
+	/** Link in the receiver's list of mailboxes. */
+	struct rlist link;
+};
+
+struct coro_sched_mt;
+struct coro_trace;
+
+struct coro_engine {
+	/**
+	 * Scheduler is the main coroutine - it represents the
+	 * context in which the scheduler itself runs.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this;
+
+	/**
+	 * Coroutines to run in this iteration of the loop. The
+	 * list gets populated once at the start of the iteration.
+	 */
+	struct rlist coros_running_now;
+	/**
+	 * Coroutines to run in the next iterations of the loop, a
+	 * queue per priority. The lists get populated by wakeups
+	 * and yields and new coros.
+	 */
+	struct rlist coros_running_next[CORO_PRIORITY_COUNT];
+	/** Number of coroutines in each of coros_running_next. */
+	size_t next_counts[CORO_PRIORITY_COUNT];
+	/** Number of coroutines in all of coros_running_next. */
+	size_t next_count;
+	/** Number of the started iterations of the loop. */
+	uint64_t loop_count;
+	/** Joined coroutines to be reused. */
+	struct rlist coros_pool;
+	/** Number of coroutines in coros_pool. */
+	size_t pool_count;
+	/** Slabs of the coroutines created in batches. */
+	struct rlist slabs;
+	/** Total number of coroutines, including the pool. */
+	size_t coro_count;
+	/** System memory page size. */
+	size_t page_size;
+	/**
+	 * Multi-threaded scheduler having this engine as one of
+	 * its workers. NULL when the engine works alone.
+	 */
+	struct coro_sched_mt *mt;
+	/** Index of the engine in the multi-threaded scheduler. */
+	int worker_id;
+	/**
+	 * Spinlock protecting coros_running_next from the other
+	 * workers stealing from it.
+	 */
+	bool next_lock;
+	/**
+	 * Coroutine which has just switched out of this thread. It
+	 * is released by the coroutine switched to.
+	 */
+	struct coro *switch_from;
+	/** Spinlock protecting the timers from the other workers. */
+	bool timer_lock;
+	/** Timeouts of the coroutines suspended on this engine. */
+	struct coro_timer_wheel timers;
+	/** Epoll descriptor, created on the first wait. -1 if none. */
+	int epoll_fd;
+	/** Number of the coroutines waiting in epoll_fd. */
+	size_t fd_wait_count;
+	/**
+	 * Coroutines waiting in epoll_fd, to find them by the
+	 * descriptor on close. Only the engine's thread uses it.
+	 */
+	struct rlist fd_waiters;
+	/** Remote wakeups of this engine's coroutines. */
+	struct coro_inbox remote_inbox;
+	/**
+	 * Inbox drained by this engine. The main engine drains its
+	 * own, in the multi-threaded mode the first worker does.
+	 */
+	struct coro_inbox *inbox;
+	/** True when the inbox eventfd is added to epoll_fd. */
+	bool is_inbox_polled;
+	/**
+	 * Engine whose inbox gets the remote wakeups of the
+	 * coroutines started here. The engine itself, or the one
+	 * running the multi-threaded scheduler with this worker.
+	 */
+	struct coro_engine *home;
+	/** Io_uring, created on the first IO. NULL if none. */
+	struct coro_uring *uring;
+	/** True when io_uring is not available to the engine. */
+	bool is_uring_off;
+	/** Number of the coroutines waiting for the io_uring IO. */
+	size_t io_wait_count;
+	/** Stacks shared by the coroutines created with no own stack. */
+	struct coro_shared_stack shared_stacks[CORO_SHARED_STACK_COUNT];
+	/** Index of the shared stack for the next new coroutine. */
+	int shared_stack_next;
+	/** Number of the not joined shared stack coroutines. */
+	size_t shared_coro_count;
+	/** Joined shared stack coroutines to be reused. */
+	struct rlist coros_shared_pool;
+	/**
+	 * Context switching the shared stacks. It runs on its own
+	 * stack, so as it could overwrite any of the shared ones.
+	 */
+	struct coro_ctx copy_ctx;
+	void *copy_stack;
+	size_t copy_stack_size;
+	/** Coroutine to switch to after the copying. */
+	struct coro *copy_to;
+	/** Scheduling counters. */
+	struct coro_sched_stats stats;
+	/** When the current coroutine got the CPU, in coro_cycles(). */
+	uint64_t run_start;
+	/** Where to record the events. NULL if tracing is off. */
+	struct coro_trace *trace;
+#if LIBCORO_USE_PREEMPT
+	/** Thread CPU time timer ticking the time slices. */
+	timer_t preempt_timer;
+#endif
+	/** True while the time slices are ticking for this engine. */
+	bool is_preempt_on;
+};
+
+/** Shared state of the multi-threaded scheduler. */
+struct coro_sched_mt {
+	/** Engines, one per worker thread. */
+	struct coro_engine *workers;
+	/** Number of the workers. */
+	int worker_count;
+	/** Number of the workers sleeping on idle_cond. */
+	int sleeper_count;
+	/** True when all the workers have run out of work. */
+	bool is_done;
+	/** Protects the idle workers' sleep. */
+	pthread_mutex_t idle_mutex;
+	/** Idle workers wait here for new work. */
+	pthread_cond_t idle_cond;
+};
+
+static void
+coro_engine_create(struct coro_engine *engine)
+{
+	memset(engine, 0, sizeof(*engine));
+	rlist_create(&engine->sched.link);
+	rlist_create(&engine->coros_running_now);
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i)
+		rlist_create(&engine->coros_running_next[i]);
+	rlist_create(&engine->coros_pool);
+	rlist_create(&engine->slabs);
+	rlist_create(&engine->coros_shared_pool);
+	coro_timer_wheel_create(&engine->timers);
+	engine->epoll_fd = -1;
+	rlist_create(&engine->fd_waiters);
+	engine->remote_inbox.fd = -1;
+	rlist_create(&engine->remote_inbox.mailboxes);
+	engine->home = engine;
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		handle_error();
+	engine->page_size = page_size;
+}
+
+/** Engine of the current thread. NULL if it has none. */
+static __thread struct coro_engine *thread_engine = NULL;
+
+/** Number of the existing engines. */
+static int coro_engine_count = 0;
+
+/** Time slice length in nanoseconds. 0 if preemption is off. */
+static uint64_t coro_preempt_slice_ns = 0;
+
+/**
+ * Set by the time slice tick, cleared when another coroutine gets
+ * the CPU. Checked by the coroutines at the safe points.
+ */
+static __thread volatile sig_atomic_t coro_preempt_flag = 0;
+
+/**
+ * True since the multi-threaded scheduler was started for the
+ * first time. From then on any coroutine can be continued on
+ * another thread and with another engine than it was suspended
+ * with. Including the coroutines suspended before that.
+ */
+static bool coro_is_mt_used = false;
+
+/**
+ * Get the engine of the current thread. Once the multi-threaded
+ * mode is used, the engine must be fetched again after each
+ * switch. The function is not inlined so as the compiler couldn't
+ * reuse the thread-local address computed before the switch.
+ */
+static __attribute__((noinline)) struct coro_engine *
+coro_engine_this_thread(void)
+{
+	return thread_engine;
+}
+
+/**
+ * Pause in a spin loop. After a number of attempts give the CPU
+ * away - the thread being waited for might be preempted and need
+ * this CPU to make progress.
+ */
+static inline void
+coro_cpu_relax(int attempt)
+{
+	if (attempt >= 128) {
+		sched_yield();
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/**
+ * Take one of the engine's spinlocks. Only needed when the engine
+ * is shared with the other workers.
+ */
+static inline void
+coro_engine_lock(struct coro_engine *engine, bool *lock)
+{
+	if (engine->mt == NULL)
+		return;
+	for (int i = 0; __atomic_test_and_set(lock, __ATOMIC_ACQUIRE); ++i)
+		coro_cpu_relax(i);
+}
+
+static inline void
+coro_engine_unlock(struct coro_engine *engine, bool *lock)
+{
+	if (engine->mt == NULL)
+		return;
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static inline enum coro_state
+coro_engine_get_state(struct coro_engine *engine, struct coro *coro)
+{
+	if (engine->mt == NULL)
+		return coro->state;
+	return __atomic_load_n(&coro->state, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+coro_engine_set_state(struct coro_engine *engine, struct coro *coro,
+	enum coro_state state)
+{
+	if (engine->mt == NULL)
+		coro->state = state;
+	else
+		__atomic_store_n(&coro->state, state, __ATOMIC_SEQ_CST);
+}
+
+enum coro_event_type {
+	CORO_EVENT_SPAWN,
+	CORO_EVENT_RESUME,
+	CORO_EVENT_SUSPEND,
+	CORO_EVENT_YIELD,
+	CORO_EVENT_WAKEUP,
+	CORO_EVENT_FINISH,
+	CORO_EVENT_JOIN,
+};
+
+static const char *coro_event_type_strs[] = {
+	"spawn", "resume", "suspend", "yield", "wakeup", "finish", "join",
+};
+
+struct coro_trace_event {
+	/** When it happened, in coro_cycles(). */
+	uint64_t cycles;
+	/** Id of the coroutine the event is about. */
+	uint64_t coro_id;
+	enum coro_event_type type;
+};
+
+/**
+ * Ring buffer of the events of one engine. It is written only by
+ * the engine's thread, and can be read by any thread at the same
+ * time. The reader detects the events overwritten while it was
+ * copying them by the head position.
+ */
+struct coro_trace {
+	/** Number of the events ever added. */
+	uint64_t head;
+	/** Capacity - 1, the capacity is a power of 2. */
+	uint64_t mask;
+	/** Thread number in the dump. */
+	int tid;
+	/** Thread name in the dump. */
+	char name[32];
+	struct coro_trace_event *events;
+};
+
+static inline void
+coro_trace_add(struct coro_trace *trace, enum coro_event_type type,
+	struct coro *coro)
+{
+	uint64_t head = trace->head;
+	struct coro_trace_event *e = &trace->events[head & trace->mask];
+	e->cycles = coro_cycles();
+	e->coro_id = coro->id;
+	e->type = type;
+	__atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/** Account an event in the counters and the trace. */
+static inline void
+coro_engine_event(struct coro_engine *engine, enum coro_event_type type,
+	struct coro *coro)
+{
+	switch (type) {
+	case CORO_EVENT_RESUME:
+		++engine->stats.switch_count;
+		break;
+	case CORO_EVENT_SUSPEND:
+		++engine->stats.suspend_count;
+		break;
+	case CORO_EVENT_YIELD:
+		++engine->stats.yield_count;
+		break;
+	case CORO_EVENT_WAKEUP:
+		++engine->stats.wakeup_count;
+		break;
+	default:
+		break;
+	}
+	if (engine->trace != NULL)
+		coro_trace_add(engine->trace, type, coro);
+}
+
+/** Wake up one of the idle workers, if there are any. */
+static void
+coro_sched_mt_notify(struct coro_sched_mt *mt)
+{
+	if (__atomic_load_n(&mt->sleeper_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&mt->idle_mutex);
+	pthread_cond_signal(&mt->idle_cond);
+	pthread_mutex_unlock(&mt->idle_mutex);
+}
+
+/** Schedule the coroutine for the next iteration of the loop. */
+static void
+coro_engine_push_next(struct coro_engine *engine, struct coro *coro)
+{
+	assert(rlist_empty(&coro->link));
+	coro_engine_lock(engine, &engine->next_lock);
+	rlist_add_tail_entry(&engine->coros_running_next[coro->priority],
+		coro, link);
+	++engine->next_counts[coro->priority];
+	if (++engine->next_count > engine->stats.next_max)
+		engine->stats.next_max = engine->next_count;
+	coro_engine_unlock(engine, &engine->next_lock);
+	if (engine->mt != NULL)
+		coro_sched_mt_notify(engine->mt);
+}
+
+/**
+ * Finish the switch on the new coroutine's side - let the other
+ * threads know the previous coroutine is not on this CPU anymore.
+ */
+static inline void
+coro_engine_switch_done(struct coro_engine *engine)
+{
+	assert(engine->mt != NULL);
+	__atomic_store_n(&engine->switch_from->is_on_cpu, false,
+		__ATOMIC_RELEASE);
+	engine->switch_from = NULL;
+}
+
+static void
+coro_body(void *arg);
+
+/** Copy the used part of the shared stack into its owner's image. */
+static void
+coro_shared_stack_save(struct coro_shared_stack *stack)
+{
+	struct coro *owner = stack->owner;
+	char *top = (char *)stack->stack + stack->size;
+	char *sp = coro_ctx_sp(&owner->ctx);
+	assert(sp >= (char *)stack->stack && sp < top);
+	size_t size = top - sp;
+	if (size > owner->image_capacity) {
+		/* Grow with a reserve for a bit deeper calls. */
+		size_t capacity = size + size / 2;
+		free(owner->image);
+		owner->image = malloc(capacity);
+		if (owner->image == NULL)
+			handle_error();
+		owner->image_capacity = capacity;
+	}
+	memcpy(owner->image, sp, size);
+	owner->image_size = size;
+	stack->owner = NULL;
+}
+
+/**
+ * Body of the context which puts the coroutines onto the shared
+ * stacks. Each iteration gives the stack to engine->copy_to and
+ * switches to it.
+ */
+static void
+coro_engine_copy_f(void *arg)
+{
+	struct coro_engine *engine = arg;
+	while (true) {
+		struct coro *to = engine->copy_to;
+		struct coro_shared_stack *stack = to->shared;
+		assert(stack->owner != to);
+		if (stack->owner != NULL)
+			coro_shared_stack_save(stack);
+		stack->owner = to;
+		if (to->image_size == 0) {
+			/* The coroutine never ran, start it. */
+			coro_ctx_create(&to->ctx, stack->stack, stack->size,
+				coro_body, to);
+		} else {
+			memcpy((char *)stack->stack + stack->size -
+				to->image_size, to->image, to->image_size);
+		}
+		coro_ctx_switch(&engine->copy_ctx, &to->ctx);
+	}
+}
+
+/**
+ * Switch from the current coroutine right to the given one. The
+ * caller takes care of scheduling the current one back, if needed.
+ */
+static inline void
+coro_engine_switch_to(struct coro_engine *engine, struct coro *to)
+{
+	struct coro *from = engine->this;
+	assert(from != NULL);
+
+	engine->this = NULL;
+#if !LIBCORO_NO_RUN_TIME
+	uint64_t now = coro_cycles();
+	from->run_cycles += now - engine->run_start;
+	engine->run_start = now;
+#endif
+	++to->switch_count;
+	coro_engine_event(engine, CORO_EVENT_RESUME, to);
+	if (engine->mt != NULL) {
+		/*
+		 * The coroutine might have been woken up by this
+		 * thread while still switching out on another one.
+		 */
+		for (int i = 0; __atomic_load_n(&to->is_on_cpu,
+			__ATOMIC_ACQUIRE); ++i)
+			coro_cpu_relax(i);
+		to->is_on_cpu = true;
+		engine->switch_from = from;
+	}
+	if (to->shared != NULL && to->shared->owner != to) {
+		/* The stack can't be replaced while running on it. */
+		engine->copy_to = to;
+		coro_ctx_switch(&from->ctx, &engine->copy_ctx);
+	} else {
+		coro_ctx_switch(&from->ctx, &to->ctx);
+	}
+	if (coro_is_mt_used) {
+		engine = coro_engine_this_thread();
+		if (engine->mt != NULL)
+			coro_engine_switch_done(engine);
+	}
+	assert(rlist_empty(&from->link));
+	assert(engine->this == NULL);
+	engine->this = from;
+}
+
+static void
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	assert(!rlist_empty(&engine->coros_running_now));
+	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
+		struct coro, link);
+	if (engine->is_preempt_on)
+		coro_preempt_flag = 0;
+	coro_engine_switch_to(engine, to);
+}
+
+/**
+ * Get the current coroutine which is going to suspend. It is an
+ * error to suspend outside of any coroutine - nothing would ever
+ * wake it up.
+ */
+static struct coro *
+coro_engine_this_to_suspend(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	if (this == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	return this;
+}
+
+static void
+coro_engine_suspend(struct coro_engine *engine)
+{
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	coro_engine_event(engine, CORO_EVENT_SUSPEND, this);
+	coro_engine_set_state(engine, this, CORO_STATE_SUSPENDED);
+	coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_yield(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	coro_engine_event(engine, CORO_EVENT_YIELD, this);
+	coro_engine_push_next(engine, this);
+	coro_engine_resume_next(engine);
+}
+
+/**
+ * Make a suspended coroutine running. It is not scheduled yet.
+ * @retval true The coroutine was suspended and the caller must
+ *         schedule it.
+ * @retval false Nothing to do, it is running or finished already.
+ */
+static bool
+coro_engine_make_running(struct coro_engine *engine, struct coro *coro)
+{
+	if (engine->mt == NULL) {
+		if (coro->state != CORO_STATE_SUSPENDED)
+			return false;
+		coro->state = CORO_STATE_RUNNING;
+		return true;
+	}
+	/* Only one of the concurrent wakeups can succeed. */
+	enum coro_state old = CORO_STATE_SUSPENDED;
+	return __atomic_compare_exchange_n(&coro->state, &old,
+		CORO_STATE_RUNNING, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Yield if the current coroutine has used up its time slice. Does
+ * nothing outside of the coroutines.
+ */
+static void
+coro_engine_check_preempt(struct coro_engine *engine)
+{
+	if (coro_preempt_flag == 0)
+		return;
+	coro_preempt_flag = 0;
+	struct coro *this = engine->this;
+	if (this == NULL || this == &engine->sched)
+		return;
+	++engine->stats.preempt_count;
+	++this->preempt_count;
+	coro_engine_yield(engine);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	if (!coro_engine_make_running(engine, coro))
+		return;
+	coro_engine_event(engine, CORO_EVENT_WAKEUP, coro);
+	coro_engine_push_next(engine, coro);
+}
+
+/**
+ * Wake up the coroutine and switch to it right away, ahead of all
+ * the other runnable ones. The current coroutine is scheduled for
+ * the next iteration of the loop, like on a yield.
+ */
+static void
+coro_engine_wakeup_and_switch(struct coro_engine *engine, struct coro *coro)
+{
+	if (!coro_engine_make_running(engine, coro))
+		return;
+	coro_engine_event(engine, CORO_EVENT_WAKEUP, coro);
+	struct coro *this = engine->this;
+	/* The scheduler itself can't wait in the run queue. */
+	if (this == NULL || this == &engine->sched) {
+		coro_engine_push_next(engine, coro);
+		return;
+	}
+	coro_engine_event(engine, CORO_EVENT_YIELD, this);
+	coro_engine_push_next(engine, this);
+	coro_engine_switch_to(engine, coro);
+}
+
+/**
+ * Suspend the current coroutine until the flag becomes not 0. The
+ * flag is set by the waker right before the wakeup. The other
+ * wakeups are ignored.
+ * @return The engine of the current thread after the wait.
+ */
+static struct coro_engine *
+coro_engine_wait_flag(struct coro_engine *engine, const int *flag)
+{
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	assert(rlist_empty(&this->link));
+	/*
+	 * The coroutine can't be woken up while running, so it is
+	 * marked suspended before checking the flag.
+	 */
+	while (true) {
+		coro_engine_set_state(engine, this, CORO_STATE_SUSPENDED);
+		if (__atomic_load_n(flag, __ATOMIC_SEQ_CST) == 0) {
+			coro_engine_event(engine, CORO_EVENT_SUSPEND, this);
+			coro_engine_resume_next(engine);
+			engine = coro_engine_this_thread();
+			continue;
+		}
+		if (!coro_engine_make_running(engine, this)) {
+			/* Already woken up and scheduled. Let it run. */
+			coro_engine_resume_next(engine);
+			engine = coro_engine_this_thread();
+		}
+		return engine;
+	}
+}
+
+/** Wake up the coroutines whose timeouts have expired. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	struct coro_timer_wheel *wheel = &engine->timers;
+	struct rlist expired;
+	struct rlist woken;
+	rlist_create(&expired);
+	rlist_create(&woken);
+	coro_engine_lock(engine, &engine->timer_lock);
+	coro_timer_wheel_advance(wheel,
+		coro_timer_wheel_tick_of(wheel, coro_clock_ns()), &expired);
+	while (!rlist_empty(&expired)) {
+		struct coro_timer *t = rlist_shift_entry(&expired,
+			struct coro_timer, link);
+		struct coro *c = rlist_entry(t, struct coro, timer);
+		t->is_armed = false;
+		/* Could be woken up explicitly already. */
+		if (!coro_engine_make_running(engine, c))
+			continue;
+		t->is_fired = true;
+		coro_engine_event(engine, CORO_EVENT_WAKEUP, c);
+		rlist_add_tail_entry(&woken, c, link);
+	}
+	coro_engine_unlock(engine, &engine->timer_lock);
+	while (!rlist_empty(&woken)) {
+		struct coro *c = rlist_shift_entry(&woken, struct coro, link);
+		coro_engine_push_next(engine, c);
+	}
+}
+
+/**
+ * Nanoseconds until the engine's timers have something to do.
+ * UINT64_MAX when there are no timers.
+ */
+static uint64_t
+coro_engine_timeout_ns(struct coro_engine *engine)
+{
+	struct coro_timer_wheel *wheel = &engine->timers;
+	coro_engine_lock(engine, &engine->timer_lock);
+	uint64_t tick = coro_timer_wheel_next_tick(wheel);
+	uint64_t start_ns = wheel->start_ns;
+	coro_engine_unlock(engine, &engine->timer_lock);
+	if (tick == UINT64_MAX)
+		return UINT64_MAX;
+	uint64_t deadline_ns = start_ns + tick * CORO_TIMER_TICK_NS;
+	uint64_t now_ns = coro_clock_ns();
+	return deadline_ns > now_ns ? deadline_ns - now_ns : 0;
+}
+
+/**
+ * Suspend the current coroutine until it is woken up or the given
+ * monotonic clock time comes.
+ * @retval true Woken up explicitly.
+ * @retval false Timed out.
+ */
+static bool
+coro_engine_suspend_until(struct coro_engine *engine, uint64_t deadline_ns)
+{
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	struct coro_timer *timer = &this->timer;
+	struct coro_timer_wheel *wheel = &engine->timers;
+	assert(!timer->is_armed);
+	/* Round up, so as not to wake up before the deadline. */
+	timer->deadline = coro_timer_wheel_tick_of(wheel,
+		deadline_ns + CORO_TIMER_TICK_NS - 1);
+	timer->is_fired = false;
+	timer->engine = engine;
+	coro_engine_lock(engine, &engine->timer_lock);
+	/* An empty wheel doesn't need to catch up tick by tick. */
+	if (coro_timer_wheel_count(wheel) == 0)
+		wheel->tick = coro_timer_wheel_tick_of(wheel, coro_clock_ns());
+	coro_timer_wheel_add(wheel, timer);
+	timer->is_armed = true;
+	coro_engine_unlock(engine, &engine->timer_lock);
+
+	coro_engine_event(engine, CORO_EVENT_SUSPEND, this);
+	coro_engine_set_state(engine, this, CORO_STATE_SUSPENDED);
+	coro_engine_resume_next(engine);
+	/*
+	 * Could be continued on another thread. The timer stays in
+	 * the wheel where it was armed.
+	 */
+	engine = timer->engine;
+	coro_engine_lock(engine, &engine->timer_lock);
+	if (timer->is_armed) {
+		coro_timer_wheel_del(&engine->timers, timer);
+		timer->is_armed = false;
+	}
+	coro_engine_unlock(engine, &engine->timer_lock);
+	return !timer->is_fired;
+}
+
+static inline size_t
+coro_engine_fd_wait_count(struct coro_engine *engine)
+{
+	return __atomic_load_n(&engine->fd_wait_count, __ATOMIC_RELAXED);
+}
+
+/** Number of the remote waiters the engine has to wait for. */
+static inline size_t
+coro_engine_inbox_wait_count(struct coro_engine *engine)
+{
+	if (engine->inbox == NULL)
+		return 0;
+	return __atomic_load_n(&engine->inbox->wait_count, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wake up the coroutines pushed into the inbox by the other
+ * threads, in the order of the pushes.
+ */
+static void
+coro_engine_drain_wakeups(struct coro_engine *engine)
+{
+	struct coro_inbox *inbox = engine->inbox;
+	if (__atomic_load_n(&inbox->head, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct coro *c = __atomic_exchange_n(&inbox->head, NULL,
+		__ATOMIC_ACQUIRE);
+	struct coro *fifo = NULL;
+	while (c != NULL) {
+		struct coro *next = c->remote_next;
+		c->remote_next = fifo;
+		fifo = c;
+		c = next;
+	}
+	while (fifo != NULL) {
+		c = fifo;
+		fifo = c->remote_next;
+		/*
+		 * From now on the coroutine can be pushed again. The
+		 * pushes skipped while it was queued are covered by
+		 * this wakeup.
+		 */
+		(void)__atomic_exchange_n(&c->is_remote_queued, false,
+			__ATOMIC_SEQ_CST);
+		if (__atomic_exchange_n(&c->is_remote_pending, 0,
+			__ATOMIC_SEQ_CST) != 0)
+			__atomic_store_n(&c->is_remote_woken, 1,
+				__ATOMIC_SEQ_CST);
+		coro_engine_wakeup(engine, c);
+	}
+}
+
+/**
+ * Run the closures which have come to the mailbox.
+ * @retval true The mailbox is closed and freed.
+ */
+static bool
+coro_mailbox_receive(struct coro_mailbox *box)
+{
+	size_t head = box->head;
+	while (true) {
+		bool is_closed = __atomic_load_n(&box->is_closed,
+			__ATOMIC_ACQUIRE);
+		size_t tail = __atomic_load_n(&box->tail, __ATOMIC_SEQ_CST);
+		if (head == tail) {
+			if (!is_closed)
+				return false;
+			rlist_del_entry(box, link);
+			__atomic_sub_fetch(&box->inbox->wait_count, 1,
+				__ATOMIC_SEQ_CST);
+			free(box->msgs);
+			free(box);
+			return true;
+		}
+		for (; head != tail; ++head) {
+			struct coro_mailbox_msg *msg = &box->msgs[head & box->mask];
+			msg->func(msg->arg);
+		}
+		/* Free the slots once per batch, not per message. */
+		__atomic_store_n(&box->head, head, __ATOMIC_SEQ_CST);
+	}
+}
+
+/** Check if any of the mailboxes has something to receive. */
+static bool
+coro_inbox_has_mail(struct coro_inbox *inbox)
+{
+	if (__atomic_load_n(&inbox->new_mailboxes, __ATOMIC_SEQ_CST) != NULL)
+		return true;
+	struct coro_mailbox *box;
+	rlist_foreach_entry(box, &inbox->mailboxes, link) {
+		if (__atomic_load_n(&box->tail, __ATOMIC_SEQ_CST) != box->head ||
+		    __atomic_load_n(&box->is_closed, __ATOMIC_SEQ_CST))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Take the remote wakeups and run the closures sent to the engine.
+ * In the multi-threaded mode only one worker does that.
+ */
+static void
+coro_engine_drain_inbox(struct coro_engine *engine)
+{
+	coro_engine_drain_wakeups(engine);
+	struct coro_inbox *inbox = engine->inbox;
+	if (__atomic_load_n(&inbox->new_mailboxes, __ATOMIC_RELAXED) != NULL) {
+		struct coro_mailbox *box = __atomic_exchange_n(
+			&inbox->new_mailboxes, NULL, __ATOMIC_ACQUIRE);
+		for (; box != NULL; box = box->new_next)
+			rlist_add_tail_entry(&inbox->mailboxes, box, link);
+	}
+	struct coro_mailbox *box, *tmp;
+	rlist_foreach_entry_safe(box, &inbox->mailboxes, link, tmp)
+		coro_mailbox_receive(box);
+}
+
+/**
+ * Wake up the receiver of the inbox if it is blocked or is going
+ * to block in poll. Nothing to do when it is busy - it checks the
+ * mailboxes on each iteration of the loop.
+ */
+static void
+coro_inbox_kick(struct coro_inbox *inbox)
+{
+	if (!__atomic_load_n(&inbox->is_polling, __ATOMIC_SEQ_CST) ||
+	    !__atomic_exchange_n(&inbox->is_polling, false, __ATOMIC_SEQ_CST))
+		return;
+	int fd = __atomic_load_n(&inbox->fd, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	if (fd >= 0 && write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+/** Push the coroutine into the inbox from any thread. */
+static void
+coro_inbox_push(struct coro_inbox *inbox, struct coro *coro)
+{
+	if (__atomic_exchange_n(&coro->is_remote_queued, true,
+		__ATOMIC_SEQ_CST))
+		return;
+	struct coro *head = __atomic_load_n(&inbox->head, __ATOMIC_RELAXED);
+	do {
+		coro->remote_next = head;
+	} while (!__atomic_compare_exchange_n(&inbox->head, &head, coro, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* A not empty inbox is already signaled. */
+	if (head != NULL)
+		return;
+	int fd = __atomic_load_n(&inbox->fd, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	if (fd >= 0 && write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+static inline size_t
+coro_engine_io_wait_count(struct coro_engine *engine)
+{
+	return __atomic_load_n(&engine->io_wait_count, __ATOMIC_RELAXED);
+}
+
+enum coro_io_op {
+	CORO_IO_READ,
+	CORO_IO_WRITE,
+	CORO_IO_ACCEPT,
+	CORO_IO_CONNECT,
+	CORO_IO_FSYNC,
+};
+
+/** IO request of a coroutine. */
+struct coro_io {
+	enum coro_io_op op;
+	int fd;
+	/** Data for read and write, address for accept and connect. */
+	void *buf;
+	/** Data size, address size for connect. */
+	size_t size;
+	/** File offset, -1 to use the file position. */
+	off_t offset;
+	/** Address size for accept. */
+	socklen_t *addr_size;
+	/** Coroutine waiting for the request. */
+	struct coro *coro;
+	/** Link in the queue of the helper threads. */
+	struct rlist link;
+};
+
+#if LIBCORO_USE_IO_URING
+
+/** Number of the submission queue entries of an engine's io_uring. */
+#define CORO_URING_ENTRIES 256
+
+struct coro_uring {
+	int fd;
+	/** Submission and completion rings, mapped together. */
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+	/** Number of the queued entries not passed to the kernel yet. */
+	unsigned to_submit;
+};
+
+/**
+ * Create an io_uring. The kernel must be 5.6 or newer, it has all
+ * the used operations and can read at the file position.
+ * @retval NULL io_uring is not available.
+ */
+static struct coro_uring *
+coro_uring_new(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, CORO_URING_ENTRIES, &params);
+	if (fd < 0)
+		return NULL;
+	unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+		IORING_FEAT_RW_CUR_POS;
+	if ((params.features & features) != features) {
+		close(fd);
+		return NULL;
+	}
+	struct coro_uring *u = malloc(sizeof(*u));
+	if (u == NULL)
+		handle_error();
+	u->fd = fd;
+	size_t sq_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	u->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->rings == MAP_FAILED)
+		handle_error();
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		handle_error();
+	char *rings = u->rings;
+	u->sq_head = (unsigned *)(rings + params.sq_off.head);
+	u->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+	u->sq_flags = (unsigned *)(rings + params.sq_off.flags);
+	u->sq_array = (unsigned *)(rings + params.sq_off.array);
+	u->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+	u->cq_head = (unsigned *)(rings + params.cq_off.head);
+	u->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+	u->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+	u->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+	u->to_submit = 0;
+	return u;
+}
+
+static void
+coro_uring_delete(struct coro_uring *u)
+{
+	if (munmap(u->sqes, u->sqes_size) != 0 ||
+	    munmap(u->rings, u->rings_size) != 0)
+		handle_error();
+	close(u->fd);
+	free(u);
+}
+
+static int
+coro_uring_enter(struct coro_uring *u, unsigned to_submit, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, u->fd, to_submit, 0, flags,
+		NULL, 0);
+}
+
+/**
+ * Pass the queued requests to the kernel. They are collected
+ * during an iteration of the loop and submitted by one call.
+ */
+static void
+coro_engine_uring_flush(struct coro_engine *engine)
+{
+	struct coro_uring *u = engine->uring;
+	if (u == NULL || u->to_submit == 0)
+		return;
+	int rc = coro_uring_enter(u, u->to_submit, 0);
+	if (rc < 0) {
+		/* Busy with the not reaped completions, will retry. */
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			return;
+		handle_error();
+	}
+	u->to_submit -= rc;
+}
+
+/**
+ * Wake up the coroutines whose requests are complete. All the
+ * ready completions are taken at once, without a system call.
+ */
+static void
+coro_engine_uring_reap(struct coro_engine *engine)
+{
+	struct coro_uring *u = engine->uring;
+	if (u == NULL)
+		return;
+	while (true) {
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+			struct coro *c = (struct coro *)(uintptr_t)cqe->user_data;
+			c->io_res = cqe->res;
+			__atomic_sub_fetch(&engine->io_wait_count, 1,
+				__ATOMIC_RELAXED);
+			__atomic_store_n(&c->is_io_done, 1, __ATOMIC_SEQ_CST);
+			if (!coro_engine_make_running(engine, c))
+				continue;
+			coro_engine_event(engine, CORO_EVENT_WAKEUP, c);
+			coro_engine_push_next(engine, c);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		/*
+		 * The completions which didn't fit into the ring are
+		 * kept by the kernel until asked for.
+		 */
+		if ((__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) &
+		     IORING_SQ_CQ_OVERFLOW) == 0)
+			return;
+		if (coro_uring_enter(u, 0, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			handle_error();
+	}
+}
+
+/**
+ * Queue the request into the engine's io_uring. The coroutine is
+ * woken up by the completion.
+ * @retval false io_uring is not available.
+ */
+static bool
+coro_engine_uring_submit(struct coro_engine *engine,
+	const struct coro_io *io);
+
+#else /* !LIBCORO_USE_IO_URING */
+
+struct coro_uring;
+
+static void
+coro_uring_delete(struct coro_uring *u)
+{
+	(void)u;
+}
+
+static void
+coro_engine_uring_flush(struct coro_engine *engine)
+{
+	(void)engine;
+}
+
+static void
+coro_engine_uring_reap(struct coro_engine *engine)
+{
+	(void)engine;
+}
+
+static bool
+coro_engine_uring_submit(struct coro_engine *engine,
+	const struct coro_io *io)
+{
+	(void)engine;
+	(void)io;
+	return false;
+}
+
+#endif /* !LIBCORO_USE_IO_URING */
+
+#if LIBCORO_USE_EPOLL
+
+/** Max number of the descriptor events fetched by one poll. */
+#define CORO_POLL_BATCH 64
+
+/**
+ * Wait for the descriptor events no longer than the given time,
+ * and wake up the coroutines waiting for them.
+ */
+static void
+coro_engine_poll(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	int timeout_ms;
+	if (timeout_ns == UINT64_MAX)
+		timeout_ms = -1;
+	else if (timeout_ns >= (uint64_t)INT_MAX * 1000000)
+		timeout_ms = INT_MAX;
+	else
+		timeout_ms = (timeout_ns + 999999) / 1000000;
+	struct epoll_event events[CORO_POLL_BATCH];
+	int count = epoll_wait(engine->epoll_fd, events, CORO_POLL_BATCH,
+		timeout_ms);
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	for (int i = 0; i < count; ++i) {
+		struct coro *c = events[i].data.ptr;
+		if (c == NULL) {
+			uint64_t value;
+			if (read(engine->inbox->fd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+			coro_engine_drain_inbox(engine);
+			continue;
+		}
+		if ((void *)c == (void *)engine->uring) {
+			coro_engine_uring_reap(engine);
+			continue;
+		}
+		uint32_t ev = events[i].events;
+		int fd_events = 0;
+		/* Errors are reported as readiness, the IO will fail. */
+		if ((ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+			fd_events |= CORO_FD_READ;
+		if ((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0)
+			fd_events |= CORO_FD_WRITE;
+		rlist_del(&c->fd_link);
+		__atomic_sub_fetch(&engine->fd_wait_count, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->fd_events, fd_events, __ATOMIC_SEQ_CST);
+		if (!coro_engine_make_running(engine, c))
+			continue;
+		coro_engine_event(engine, CORO_EVENT_WAKEUP, c);
+		coro_engine_push_next(engine, c);
+	}
+}
+
+static int
+coro_engine_epoll_fd(struct coro_engine *engine)
+{
+	if (engine->epoll_fd < 0) {
+		engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (engine->epoll_fd < 0)
+			handle_error();
+	}
+	return engine->epoll_fd;
+}
+
+/**
+ * Wait for the descriptor events and the remote wakeups. The
+ * inbox eventfd is added to epoll before the first such wait.
+ */
+static void
+coro_engine_poll_all(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	struct coro_inbox *inbox = engine->inbox;
+	if (inbox != NULL && !engine->is_inbox_polled &&
+	    __atomic_load_n(&inbox->fd, __ATOMIC_ACQUIRE) >= 0) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(coro_engine_epoll_fd(engine), EPOLL_CTL_ADD,
+			inbox->fd, &ev) != 0)
+			handle_error();
+		engine->is_inbox_polled = true;
+	}
+	if (inbox == NULL) {
+		coro_engine_poll(engine, timeout_ns);
+		return;
+	}
+	/*
+	 * A sender either sees the flag and signals, or its message
+	 * is seen here.
+	 */
+	__atomic_store_n(&inbox->is_polling, true, __ATOMIC_SEQ_CST);
+	if (coro_inbox_has_mail(inbox))
+		timeout_ns = 0;
+	coro_engine_poll(engine, timeout_ns);
+	__atomic_store_n(&inbox->is_polling, false, __ATOMIC_SEQ_CST);
+	coro_engine_drain_inbox(engine);
+}
+
+/** Create the inbox eventfd, if not yet. Thread-safe. */
+static void
+coro_inbox_open(struct coro_inbox *inbox)
+{
+	if (__atomic_load_n(&inbox->fd, __ATOMIC_ACQUIRE) >= 0)
+		return;
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		handle_error();
+	int old = -1;
+	if (!__atomic_compare_exchange_n(&inbox->fd, &old, fd, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		close(fd);
+}
+
+/**
+ * Suspend the current coroutine until the descriptor gets any of
+ * the events. The registration is one-shot, it is removed from
+ * epoll when the coroutine is woken up.
+ */
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events)
+{
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	coro_engine_epoll_fd(engine);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLONESHOT;
+	if ((events & CORO_FD_READ) != 0)
+		ev.events |= EPOLLIN;
+	if ((events & CORO_FD_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = this;
+	this->fd_events = 0;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return -1;
+	this->fd = fd;
+	rlist_add_tail(&engine->fd_waiters, &this->fd_link);
+	__atomic_add_fetch(&engine->fd_wait_count, 1, __ATOMIC_RELAXED);
+	coro_engine_wait_flag(engine, &this->fd_events);
+	/* The number of a closed descriptor can be reused already. */
+	if (this->fd >= 0)
+		epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	return this->fd_events & events;
+}
+
+/**
+ * Close the descriptor and wake up its waiter of this engine, if
+ * any. The kernel drops a closed descriptor from epoll silently,
+ * so otherwise the waiter would sleep forever. The waiter gets the
+ * descriptor as ready for everything, and its IO fails.
+ */
+static int
+coro_engine_close(struct coro_engine *engine, int fd)
+{
+	struct coro *c;
+	rlist_foreach_entry(c, &engine->fd_waiters, fd_link) {
+		if (c->fd != fd)
+			continue;
+		rlist_del(&c->fd_link);
+		epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		c->fd = -1;
+		__atomic_sub_fetch(&engine->fd_wait_count, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->fd_events, CORO_FD_READ | CORO_FD_WRITE,
+			__ATOMIC_SEQ_CST);
+		coro_engine_wakeup(engine, c);
+		break;
+	}
+	return close(fd);
+}
+
+#if LIBCORO_USE_IO_URING
+
+/**
+ * Get the engine's io_uring, create it on the first call. Its
+ * descriptor is polled with the others, so the scheduler wakes up
+ * when the completions arrive.
+ * @retval NULL io_uring is not available.
+ */
+static struct coro_uring *
+coro_engine_uring(struct coro_engine *engine)
+{
+	if (engine->uring != NULL || engine->is_uring_off)
+		return engine->uring;
+	struct coro_uring *u = coro_uring_new();
+	if (u == NULL) {
+		engine->is_uring_off = true;
+		return NULL;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = u;
+	if (epoll_ctl(coro_engine_epoll_fd(engine), EPOLL_CTL_ADD, u->fd,
+		&ev) != 0)
+		handle_error();
+	engine->uring = u;
+	return u;
+}
+
+static bool
+coro_engine_uring_submit(struct coro_engine *engine,
+	const struct coro_io *io)
+{
+	struct coro_uring *u = coro_engine_uring(engine);
+	if (u == NULL)
+		return false;
+	unsigned tail = *u->sq_tail;
+	while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >
+	       u->sq_mask) {
+		/* The ring is full. Make room, reaping if it is busy. */
+		coro_engine_uring_flush(engine);
+		coro_engine_uring_reap(engine);
+	}
+	unsigned index = tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = io->fd;
+	sqe->user_data = (uintptr_t)io->coro;
+	switch (io->op) {
+	case CORO_IO_READ:
+	case CORO_IO_WRITE:
+		sqe->opcode = io->op == CORO_IO_READ ? IORING_OP_READ :
+			IORING_OP_WRITE;
+		sqe->addr = (uintptr_t)io->buf;
+		/* The result is an int, the rest is a short IO. */
+		sqe->len = io->size > INT_MAX ? INT_MAX : io->size;
+		sqe->off = io->offset;
+		break;
+	case CORO_IO_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->addr = (uintptr_t)io->buf;
+		sqe->addr2 = (uintptr_t)io->addr_size;
+		break;
+	case CORO_IO_CONNECT:
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->addr = (uintptr_t)io->buf;
+		sqe->off = io->size;
+		break;
+	case CORO_IO_FSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		break;
+	}
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++u->to_submit;
+	return true;
+}
+
+#endif /* LIBCORO_USE_IO_URING */
+
+#else /* !LIBCORO_USE_EPOLL */
+
+/**
+ * Without epoll only the remote wakeups can be waited for. The
+ * inbox is checked each timer tick.
+ */
+static void
+coro_engine_poll_all(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	if (timeout_ns > CORO_TIMER_TICK_NS)
+		timeout_ns = CORO_TIMER_TICK_NS;
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = timeout_ns;
+	nanosleep(&ts, NULL);
+	coro_engine_drain_inbox(engine);
+}
+
+static void
+coro_inbox_open(struct coro_inbox *inbox)
+{
+	(void)inbox;
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events)
+{
+	(void)engine;
+	(void)fd;
+	(void)events;
+	errno = ENOSYS;
+	return -1;
+}
+
+static int
+coro_engine_close(struct coro_engine *engine, int fd)
+{
+	(void)engine;
+	return close(fd);
+}
+
+#endif /* !LIBCORO_USE_EPOLL */
+
+/**
+ * Count one more coroutine waiting for the remote inbox. In the
+ * multi-threaded mode the worker draining the inbox could fall
+ * asleep while there were no such waiters. Then it is woken up to
+ * poll the inbox.
+ */
+static void
+coro_engine_inbox_wait_begin(struct coro_engine *engine)
+{
+	struct coro_inbox *inbox = &engine->home->remote_inbox;
+	coro_inbox_open(inbox);
+	if (__atomic_add_fetch(&inbox->wait_count, 1, __ATOMIC_SEQ_CST) != 1 ||
+	    engine->mt == NULL)
+		return;
+	struct coro_sched_mt *mt = engine->mt;
+	pthread_mutex_lock(&mt->idle_mutex);
+	pthread_cond_broadcast(&mt->idle_cond);
+	pthread_mutex_unlock(&mt->idle_mutex);
+}
+
+static void
+coro_engine_inbox_wait_end(struct coro_engine *engine)
+{
+	struct coro_inbox *inbox = &engine->home->remote_inbox;
+	if (__atomic_sub_fetch(&inbox->wait_count, 1, __ATOMIC_SEQ_CST) != 0 ||
+	    engine->mt == NULL || inbox->fd < 0)
+		return;
+	/*
+	 * The worker draining the inbox could be polling it for this
+	 * coroutine, already woken up and stolen by another worker.
+	 * Kick it to see there are no waiters anymore.
+	 */
+	uint64_t one = 1;
+	if (write(inbox->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+/**
+ * Suspend the current coroutine until coro_wakeup_remote(). If the
+ * wakeup has come already, return right away. The scheduler doesn't
+ * stop while there are such waiters.
+ * @return The engine of the current thread after the wait.
+ */
+static struct coro_engine *
+coro_engine_suspend_remote(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	coro_engine_inbox_wait_begin(engine);
+	engine = coro_engine_wait_flag(engine, &this->is_remote_woken);
+	coro_engine_inbox_wait_end(engine);
+	__atomic_store_n(&this->is_remote_woken, 0, __ATOMIC_SEQ_CST);
+	return engine;
+}
+
+/** Number of the helper threads doing the IO without io_uring. */
+#define CORO_IO_THREAD_COUNT 4
+
+/**
+ * Helper threads doing the blocking IO calls for the coroutines.
+ * They are started on the first request and are shared by all the
+ * engines. The completions are delivered through the remote inbox.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** Requests waiting for a free thread. */
+	struct rlist queue;
+	pthread_t threads[CORO_IO_THREAD_COUNT];
+	/** Number of the started threads. */
+	int thread_count;
+	/** True when the threads should exit. */
+	bool is_stopped;
+} coro_io_threads = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.queue = RLIST_HEAD_INITIALIZER(coro_io_threads.queue),
+};
+
+/**
+ * Do the request with the blocking system calls. A not blocking
+ * descriptor is waited for with poll(), so the result is the same
+ * as with io_uring.
+ */
+static ssize_t
+coro_io_do(const struct coro_io *io)
+{
+	while (true) {
+		ssize_t rc = -1;
+		short events = POLLIN;
+		switch (io->op) {
+		case CORO_IO_READ:
+			if (io->offset < 0)
+				rc = read(io->fd, io->buf, io->size);
+			else
+				rc = pread(io->fd, io->buf, io->size, io->offset);
+			break;
+		case CORO_IO_WRITE:
+			events = POLLOUT;
+			if (io->offset < 0)
+				rc = write(io->fd, io->buf, io->size);
+			else
+				rc = pwrite(io->fd, io->buf, io->size, io->offset);
+			break;
+		case CORO_IO_ACCEPT:
+			rc = accept(io->fd, io->buf, io->addr_size);
+			break;
+		case CORO_IO_CONNECT:
+			rc = connect(io->fd, io->buf, io->size);
+			if (rc == 0 || errno != EINPROGRESS)
+				return rc;
+			/* The connection result comes as writability. */
+			struct pollfd pfd = {.fd = io->fd, .events = POLLOUT};
+			while (poll(&pfd, 1, -1) < 0) {
+				if (errno != EINTR)
+					return -1;
+			}
+			int err = 0;
+			socklen_t err_size = sizeof(err);
+			if (getsockopt(io->fd, SOL_SOCKET, SO_ERROR, &err,
+				&err_size) != 0)
+				return -1;
+			if (err == 0)
+				return 0;
+			errno = err;
+			return -1;
+		case CORO_IO_FSYNC:
+			rc = fsync(io->fd);
+			break;
+		}
+		if (rc >= 0)
+			return rc;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		struct pollfd pfd = {.fd = io->fd, .events = events};
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+static void *
+coro_io_thread_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_io_threads.mutex);
+	while (true) {
+		while (rlist_empty(&coro_io_threads.queue) &&
+		       !coro_io_threads.is_stopped)
+			pthread_cond_wait(&coro_io_threads.cond,
+				&coro_io_threads.mutex);
+		if (rlist_empty(&coro_io_threads.queue))
+			break;
+		struct coro_io *io = rlist_shift_entry(&coro_io_threads.queue,
+			struct coro_io, link);
+		pthread_mutex_unlock(&coro_io_threads.mutex);
+
+		ssize_t rc = coro_io_do(io);
+		struct coro *c = io->coro;
+		free(io);
+		c->io_res = rc < 0 ? -errno : rc;
+		__atomic_store_n(&c->is_io_done, 1, __ATOMIC_SEQ_CST);
+		coro_inbox_push(&c->home->remote_inbox, c);
+
+		pthread_mutex_lock(&coro_io_threads.mutex);
+	}
+	pthread_mutex_unlock(&coro_io_threads.mutex);
+	return NULL;
+}
+
+/** Queue the request to the helper threads, start them if needed. */
+static void
+coro_io_threads_push(struct coro_io *io)
+{
+	pthread_mutex_lock(&coro_io_threads.mutex);
+	if (coro_io_threads.thread_count == 0) {
+		coro_io_threads.is_stopped = false;
+		for (int i = 0; i < CORO_IO_THREAD_COUNT; ++i) {
+			if (pthread_create(&coro_io_threads.threads[i], NULL,
+				coro_io_thread_f, NULL) != 0)
+				handle_error();
+		}
+		coro_io_threads.thread_count = CORO_IO_THREAD_COUNT;
+	}
+	rlist_add_tail_entry(&coro_io_threads.queue, io, link);
+	pthread_cond_signal(&coro_io_threads.cond);
+	pthread_mutex_unlock(&coro_io_threads.mutex);
+}
+
+static void
+coro_io_threads_stop(void)
+{
+	pthread_mutex_lock(&coro_io_threads.mutex);
+	int count = coro_io_threads.thread_count;
+	coro_io_threads.thread_count = 0;
+	coro_io_threads.is_stopped = true;
+	pthread_cond_broadcast(&coro_io_threads.cond);
+	pthread_mutex_unlock(&coro_io_threads.mutex);
+	for (int i = 0; i < count; ++i)
+		pthread_join(coro_io_threads.threads[i], NULL);
+}
+
+/**
+ * Do the IO request in the background and suspend the current
+ * coroutine until it is complete.
+ * @retval >=0 The request result.
+ * @retval -1 Error, errno is set.
+ */
+static ssize_t
+coro_engine_io(struct coro_engine *engine, struct coro_io *io)
+{
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	assert(rlist_empty(&this->link));
+	io->coro = this;
+	this->is_io_done = 0;
+	__atomic_add_fetch(&engine->io_wait_count, 1, __ATOMIC_RELAXED);
+	if (coro_engine_uring_submit(engine, io)) {
+		coro_engine_wait_flag(engine, &this->is_io_done);
+	} else {
+		__atomic_sub_fetch(&engine->io_wait_count, 1, __ATOMIC_RELAXED);
+		struct coro_io *task = malloc(sizeof(*task));
+		if (task == NULL)
+			handle_error();
+		*task = *io;
+		coro_engine_inbox_wait_begin(engine);
+		coro_io_threads_push(task);
+		engine = coro_engine_wait_flag(engine, &this->is_io_done);
+		coro_engine_inbox_wait_end(engine);
+	}
+	if (this->io_res < 0) {
+		errno = -this->io_res;
+		return -1;
+	}
+	return this->io_res;
+}
+
+/**
+ * Steal a half of the coroutines scheduled for the next iteration
+ * on another worker.
+ */
+static bool
+coro_engine_steal(struct coro_engine *engine)
+{
+	struct coro_sched_mt *mt = engine->mt;
+	for (int i = 1; i < mt->worker_count; ++i) {
+		struct coro_engine *victim =
+			&mt->workers[(engine->worker_id + i) % mt->worker_count];
+		if (__atomic_load_n(&victim->next_count, __ATOMIC_RELAXED) == 0)
+			continue;
+		struct rlist stolen[CORO_PRIORITY_COUNT];
+		size_t counts[CORO_PRIORITY_COUNT];
+		size_t count = 0;
+		coro_engine_lock(victim, &victim->next_lock);
+		for (int p = 0; p < CORO_PRIORITY_COUNT; ++p) {
+			rlist_create(&stolen[p]);
+			counts[p] = (victim->next_counts[p] + 1) / 2;
+			victim->next_counts[p] -= counts[p];
+			for (size_t j = 0; j < counts[p]; ++j) {
+				rlist_move_tail(&stolen[p], rlist_first(
+					&victim->coros_running_next[p]));
+			}
+			count += counts[p];
+		}
+		victim->next_count -= count;
+		coro_engine_unlock(victim, &victim->next_lock);
+		if (count == 0)
+			continue;
+
+		coro_engine_lock(engine, &engine->next_lock);
+		for (int p = 0; p < CORO_PRIORITY_COUNT; ++p) {
+			rlist_splice_tail(&engine->coros_running_next[p],
+				&stolen[p]);
+			engine->next_counts[p] += counts[p];
+		}
+		engine->next_count += count;
+		coro_engine_unlock(engine, &engine->next_lock);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Find work for an idle worker. Steal it from the others or sleep
+ * until it appears.
+ * @retval true There might be new work.
+ * @retval false All the workers are idle, the scheduler is done.
+ */
+static bool
+coro_engine_wait_work(struct coro_engine *engine)
+{
+	struct coro_sched_mt *mt = engine->mt;
+	if (coro_engine_steal(engine))
+		return true;
+	if (coro_engine_fd_wait_count(engine) != 0 ||
+	    coro_engine_io_wait_count(engine) != 0 ||
+	    coro_engine_inbox_wait_count(engine) != 0) {
+		/*
+		 * Only this worker can see the events of its
+		 * descriptors, io_uring, and inbox. It doesn't sleep with the
+		 * others, so the scheduler is not done until they
+		 * arrive.
+		 */
+		coro_engine_poll_all(engine, coro_engine_timeout_ns(engine));
+		return true;
+	}
+	pthread_mutex_lock(&mt->idle_mutex);
+	if (mt->is_done) {
+		pthread_mutex_unlock(&mt->idle_mutex);
+		return false;
+	}
+	/* Remote waiters have appeared since the check above. */
+	if (coro_engine_inbox_wait_count(engine) != 0) {
+		pthread_mutex_unlock(&mt->idle_mutex);
+		return true;
+	}
+	/*
+	 * The coroutines are always scheduled into the queue of
+	 * the thread which wakes them up. When all the workers are
+	 * idle and no timers are pending, nobody can produce more
+	 * work.
+	 */
+	if (mt->sleeper_count + 1 == mt->worker_count) {
+		size_t wait_count = 0;
+		for (int i = 0; i < mt->worker_count; ++i) {
+			struct coro_engine *w = &mt->workers[i];
+			wait_count += coro_timer_wheel_count(&w->timers) +
+				coro_engine_fd_wait_count(w) +
+				coro_engine_io_wait_count(w) +
+				coro_engine_inbox_wait_count(w);
+		}
+		if (wait_count == 0) {
+			mt->is_done = true;
+			pthread_cond_broadcast(&mt->idle_cond);
+			pthread_mutex_unlock(&mt->idle_mutex);
+			return false;
+		}
+	}
+	__atomic_add_fetch(&mt->sleeper_count, 1, __ATOMIC_SEQ_CST);
+	uint64_t timeout_ns = coro_engine_timeout_ns(engine);
+	if (timeout_ns == UINT64_MAX) {
+		pthread_cond_wait(&mt->idle_cond, &mt->idle_mutex);
+	} else if (timeout_ns > 0) {
+		/* The condition variable uses the realtime clock. */
+		struct timespec ts;
+		if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+			handle_error();
+		uint64_t ns = ts.tv_nsec + timeout_ns;
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait(&mt->idle_cond, &mt->idle_mutex, &ts);
+	}
+	__atomic_sub_fetch(&mt->sleeper_count, 1, __ATOMIC_SEQ_CST);
+	bool is_done = mt->is_done;
+	pthread_mutex_unlock(&mt->idle_mutex);
+	return !is_done;
+}
+
+#if LIBCORO_USE_PREEMPT
+
+static void
+coro_preempt_handler(int signo)
+{
+	(void)signo;
+	coro_preempt_flag = 1;
+}
+
+/**
+ * Start ticking the time slices on the current thread, if the
+ * preemption is on. The ticks count the thread CPU time, so an idle
+ * thread is not woken up by them.
+ */
+static void
+coro_engine_preempt_start(struct coro_engine *engine)
+{
+	uint64_t slice_ns = coro_preempt_slice_ns;
+	if (slice_ns == 0)
+		return;
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGALRM;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev,
+		&engine->preempt_timer) != 0)
+		handle_error();
+	struct itimerspec its;
+	its.it_value.tv_sec = slice_ns / 1000000000;
+	its.it_value.tv_nsec = slice_ns % 1000000000;
+	its.it_interval = its.it_value;
+	if (timer_settime(engine->preempt_timer, 0, &its, NULL) != 0)
+		handle_error();
+	engine->is_preempt_on = true;
+	coro_preempt_flag = 0;
+}
+
+static void
+coro_engine_preempt_stop(struct coro_engine *engine)
+{
+	if (!engine->is_preempt_on)
+		return;
+	if (timer_delete(engine->preempt_timer) != 0)
+		handle_error();
+	engine->is_preempt_on = false;
+	coro_preempt_flag = 0;
+}
+
+#else /* !LIBCORO_USE_PREEMPT */
+
+static void
+coro_engine_preempt_start(struct coro_engine *engine)
+{
+	(void)engine;
+}
+
+static void
+coro_engine_preempt_stop(struct coro_engine *engine)
+{
+	(void)engine;
+}
+
+#endif /* !LIBCORO_USE_PREEMPT */
+
+/**
+ * Each priority gets into the iteration of the loop once in this
+ * number of iterations. When all the levels are busy, a high
+ * priority coroutine runs 4 times and a normal one 2 times per
+ * each run of a low priority one. Nobody starves.
+ */
+static const uint64_t coro_priority_period[CORO_PRIORITY_COUNT] = {
+	1, 2, 4,
+};
+
+/**
+ * Move the coroutines whose priorities are due in this iteration
+ * to the list of the running now, higher priorities first. If none
+ * are due, the iteration takes whatever is ready.
+ */
+static void
+coro_engine_take_next(struct coro_engine *engine)
+{
+	uint64_t loop = engine->loop_count++;
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int p = 0; p < CORO_PRIORITY_COUNT; ++p) {
+			if (pass == 0 && loop % coro_priority_period[p] != 0)
+				continue;
+			rlist_splice_tail(&engine->coros_running_now,
+				&engine->coros_running_next[p]);
+			engine->next_count -= engine->next_counts[p];
+			engine->next_counts[p] = 0;
+		}
+		if (!rlist_empty(&engine->coros_running_now))
+			break;
+	}
+}
+
+static void
+coro_engine_loop(struct coro_engine *engine)
+{
+	coro_engine_preempt_start(engine);
+	while (true) {
+		assert(rlist_empty(&engine->coros_running_now));
+		if (coro_timer_wheel_count(&engine->timers) != 0)
+			coro_engine_process_timers(engine);
+		if (coro_engine_fd_wait_count(engine) != 0)
+			coro_engine_poll(engine, 0);
+		if (coro_engine_io_wait_count(engine) != 0) {
+			coro_engine_uring_flush(engine);
+			coro_engine_uring_reap(engine);
+		}
+		if (engine->inbox != NULL)
+			coro_engine_drain_inbox(engine);
+		coro_engine_lock(engine, &engine->next_lock);
+		coro_engine_take_next(engine);
+		coro_engine_unlock(engine, &engine->next_lock);
+		if (rlist_empty(&engine->coros_running_now)) {
+			if (engine->mt != NULL) {
+				if (coro_engine_wait_work(engine))
+					continue;
+				break;
+			}
+			uint64_t timeout_ns = coro_engine_timeout_ns(engine);
+			if (coro_engine_fd_wait_count(engine) != 0 ||
+			    coro_engine_io_wait_count(engine) != 0 ||
+			    coro_engine_inbox_wait_count(engine) != 0) {
+				coro_engine_poll_all(engine, timeout_ns);
+				continue;
+			}
+			if (timeout_ns == UINT64_MAX)
+				break;
+			struct timespec ts;
+			ts.tv_sec = timeout_ns / 1000000000;
+			ts.tv_nsec = timeout_ns % 1000000000;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		assert(engine->this == NULL);
+		engine->this = &engine->sched;
+		assert(rlist_empty(&engine->sched.link));
+		/*
+		 * Add the scheduler to the tail so the control
+		 * comes back in the end of this iteration of the
+		 * loop.
+		 */
+		rlist_add_tail_entry(&engine->coros_running_now,
+			&engine->sched, link);
+		engine->run_start = coro_cycles();
+		coro_engine_resume_next(engine);
+		assert(rlist_empty(&engine->coros_running_now));
+		assert(engine->this == &engine->sched);
+		engine->this = NULL;
+	}
+	coro_engine_preempt_stop(engine);
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this == NULL);
+	assert(rlist_empty(&engine->coros_running_now));
+	assert(engine->next_count == 0);
+	while (!rlist_empty(&engine->coros_pool)) {
+		struct coro *c = rlist_shift_entry(&engine->coros_pool,
+			struct coro, link);
+		assert(engine->pool_count > 0);
+		--engine->pool_count;
+		free(c->specific_ext);
+		if (c->slab == NULL) {
+			coro_stack_delete(c->stack, c->stack_size,
+				engine->page_size);
+			free(c);
+		}
+		assert(engine->coro_count > 0);
+		--engine->coro_count;
+	}
+	assert(engine->pool_count == 0);
+	while (!rlist_empty(&engine->slabs)) {
+		struct coro_slab *slab = rlist_shift_entry(&engine->slabs,
+			struct coro_slab, link);
+		if (munmap(slab->stacks, slab->stacks_size) != 0)
+			handle_error();
+		free(slab);
+	}
+	while (!rlist_empty(&engine->coros_shared_pool)) {
+		struct coro *c = rlist_shift_entry(&engine->coros_shared_pool,
+			struct coro, link);
+		free(c->image);
+		free(c->specific_ext);
+		free(c);
+		assert(engine->coro_count > 0);
+		--engine->coro_count;
+	}
+	assert(engine->coro_count == 0);
+	assert(engine->shared_coro_count == 0);
+	for (int i = 0; i < CORO_SHARED_STACK_COUNT; ++i) {
+		struct coro_shared_stack *stack = &engine->shared_stacks[i];
+		if (stack->stack != NULL) {
+			coro_stack_delete(stack->stack, stack->size,
+				engine->page_size);
+		}
+	}
+	if (engine->copy_stack != NULL) {
+		coro_stack_delete(engine->copy_stack, engine->copy_stack_size,
+			engine->page_size);
+	}
+	assert(coro_timer_wheel_count(&engine->timers) == 0);
+	assert(engine->fd_wait_count == 0);
+	assert(engine->io_wait_count == 0);
+	if (engine->uring != NULL)
+		coro_uring_delete(engine->uring);
+	if (engine->epoll_fd >= 0)
+		close(engine->epoll_fd);
+	assert(engine->remote_inbox.wait_count == 0);
+	assert(engine->remote_inbox.new_mailboxes == NULL);
+	assert(rlist_empty(&engine->remote_inbox.mailboxes));
+	if (engine->remote_inbox.fd >= 0)
+		close(engine->remote_inbox.fd);
+	memset(engine, '#', sizeof(*engine));
+}
+
+/** Number of the created coroutine-local keys. */
+static unsigned coro_key_count = 0;
+/** Destructors of the keys' values, can be NULL. */
+static void (*coro_key_destructors[CORO_KEYS_MAX])(void *);
+
+/**
+ * Call the destructors of the coroutine-local values, right after
+ * the coroutine function returns.
+ */
+static void
+coro_specific_destroy(struct coro *c)
+{
+	unsigned count = __atomic_load_n(&coro_key_count, __ATOMIC_ACQUIRE);
+	for (unsigned key = 0; key < count; ++key) {
+		void (*destructor)(void *) = coro_key_destructors[key];
+		if (destructor == NULL)
+			continue;
+		void **slot;
+		if (key < CORO_KEYS_INLINE)
+			slot = &c->specific[key];
+		else if (c->specific_ext != NULL)
+			slot = &c->specific_ext[key - CORO_KEYS_INLINE];
+		else
+			break;
+		void *value = *slot;
+		if (value == NULL)
+			continue;
+		*slot = NULL;
+		destructor(value);
+	}
+}
+
+/** Clear the coroutine-local values before the coroutine reuse. */
+static inline void
+coro_specific_clear(struct coro *c)
+{
+	memset(c->specific, 0, sizeof(c->specific));
+	if (c->specific_ext != NULL) {
+		memset(c->specific_ext, 0, sizeof(c->specific_ext[0]) *
+			(CORO_KEYS_MAX - CORO_KEYS_INLINE));
+	}
+}
+
+/**
+ * Entry point of every coroutine. A finished coroutine doesn't
+ * leave it - when reused from the pool, it simply starts the next
+ * function in the loop.
+ */
+static void
+coro_body(void *arg)
+{
+	struct coro *c = arg;
+	/*
+	 * The coroutine is entered from coro_engine_resume_next()
+	 * which doesn't know whom it switches to.
+	 */
+	struct coro_engine *my_engine = coro_engine_this_thread();
+	if (my_engine->mt != NULL)
+		coro_engine_switch_done(my_engine);
+	assert(my_engine->this == NULL);
+	my_engine->this = c;
+	c->stack_live = (char *)__builtin_frame_address(0) -
+		CORO_STACK_LIVE_MARGIN;
+	while (true) {
+		c->ret = c->func(c->func_arg);
+		if (coro_key_count != 0)
+			coro_specific_destroy(c);
+		if (coro_stack_mode != CORO_STACK_FIXED && c->shared == NULL) {
+			c->stack_usage = coro_stack_used(c->stack,
+				c->stack_size, my_engine->page_size);
+			if (coro_stack_mode == CORO_STACK_ADAPTIVE)
+				coro_stack_hint_update(c->func, c->stack_usage);
+		}
+		c->func = NULL;
+		/*
+		 * The stack is not needed until the coroutine is
+		 * reused. Release it right here while it is known for
+		 * sure which part is not used.
+		 */
+		if (c->shared == NULL) {
+			coro_stack_release(c->stack, c->stack_live,
+				my_engine->page_size);
+		}
+		if (coro_is_mt_used)
+			my_engine = coro_engine_this_thread();
+		assert(c->state == CORO_STATE_RUNNING);
+		coro_engine_event(my_engine, CORO_EVENT_FINISH, c);
+		coro_engine_set_state(my_engine, c, CORO_STATE_FINISHED);
+		struct coro *joiner = my_engine->mt == NULL ? c->joiner :
+			__atomic_load_n(&c->joiner, __ATOMIC_SEQ_CST);
+		if (joiner != NULL)
+			coro_engine_wakeup(my_engine, joiner);
+		if (c->gen != NULL) {
+			/* The consumer waits for the end in coro_gen_next(). */
+			coro_engine_switch_to(my_engine, c->gen->consumer);
+		} else {
+			coro_engine_resume_next(my_engine);
+		}
+		/*
+		 * Here it is restarted already, must have its
+		 * state restored.
+		 */
+		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+	}
+}
+
+/** Last given coroutine id. */
+static uint64_t coro_id_last = 0;
+
+/** Initialize a coroutine with no stack. */
+static void
+coro_init(struct coro *c)
+{
+	c->ret = NULL;
+	c->stack = NULL;
+	c->stack_size = 0;
+	c->stack_live = NULL;
+	c->is_on_cpu = false;
+	c->timer.is_armed = false;
+	c->timer.is_fired = false;
+	c->timer.engine = NULL;
+	rlist_create(&c->timer.link);
+	c->joiner = NULL;
+	c->shared = NULL;
+	c->image = NULL;
+	c->image_size = 0;
+	c->image_capacity = 0;
+	c->remote_next = NULL;
+	c->is_remote_queued = false;
+	c->is_remote_woken = 0;
+	c->is_remote_pending = 0;
+	c->home = NULL;
+	c->slab = NULL;
+	c->gen = NULL;
+	memset(c->specific, 0, sizeof(c->specific));
+	c->specific_ext = NULL;
+	rlist_create(&c->link);
+}
+
+/** Allocate a coroutine with no stack. */
+static struct coro *
+coro_alloc(void)
+{
+	struct coro *c = malloc(sizeof(*c));
+	if (c == NULL)
+		handle_error();
+	coro_init(c);
+	return c;
+}
+
+/** Size of a stack to give to a coroutine asking for @a size. */
+static size_t
+coro_stack_size_fit(size_t size)
+{
+	if (size < CORO_STACK_LIVE_MARGIN * 2)
+		size = CORO_STACK_LIVE_MARGIN * 2;
+	if ((long)size < (long)SIGSTKSZ)
+		size = SIGSTKSZ;
+	return size;
+}
+
+/**
+ * Prepare a new or a reused coroutine to run the function. It is
+ * not scheduled yet.
+ */
+static void
+coro_engine_prepare(struct coro_engine *engine, struct coro *c, coro_f func,
+	void *func_arg)
+{
+	c->func = func;
+	c->func_arg = func_arg;
+	c->state = CORO_STATE_RUNNING;
+	c->id = __atomic_add_fetch(&coro_id_last, 1, __ATOMIC_RELAXED);
+	c->switch_count = 0;
+	c->run_cycles = 0;
+	c->preempt_count = 0;
+	c->priority = CORO_PRIORITY_NORMAL;
+	c->stack_usage = 0;
+	c->is_remote_woken = 0;
+	c->home = engine->home;
+	coro_engine_event(engine, CORO_EVENT_SPAWN, c);
+}
+
+/**
+ * Start a new or a reused coroutine. Now the scheduler can work
+ * with it.
+ */
+static void
+coro_engine_start(struct coro_engine *engine, struct coro *c, coro_f func,
+	void *func_arg)
+{
+	coro_engine_prepare(engine, c, func, func_arg);
+	coro_engine_push_next(engine, c);
+}
+
+/** Create a coroutine with a new stack. NULL on a mapping error. */
+static struct coro *
+coro_engine_take_new(struct coro_engine *engine, size_t stack_size)
+{
+	struct coro *c = coro_alloc();
+	stack_size = coro_stack_size_fit(stack_size);
+	c->stack = coro_stack_new(&stack_size, engine->page_size);
+	if (c->stack == NULL) {
+		free(c);
+		return NULL;
+	}
+	c->stack_size = stack_size;
+	c->stack_live = (char *)c->stack + stack_size;
+	coro_ctx_create(&c->ctx, c->stack, stack_size, coro_body, c);
+	++engine->coro_count;
+	return c;
+}
+
+/**
+ * Get a not started coroutine with a stack of at least the given
+ * size. Only the first coroutine in the pool is checked for reuse,
+ * so as the spawn stays O(1). A pooled coroutine with a smaller
+ * stack is left for the smaller requests.
+ */
+static struct coro *
+coro_engine_take(struct coro_engine *engine, size_t stack_size)
+{
+	struct coro *c;
+	if (rlist_empty(&engine->coros_pool))
+		return coro_engine_take_new(engine, stack_size);
+	c = rlist_first_entry(&engine->coros_pool, struct coro, link);
+	if (c->stack_size < stack_size)
+		return coro_engine_take_new(engine, stack_size);
+
+	rlist_del_entry(c, link);
+	--engine->pool_count;
+	if (coro_stack_mode == CORO_STACK_ADAPTIVE &&
+	    c->stack_size >= stack_size * 2) {
+		size_t size = coro_stack_size_fit(stack_size);
+		char *top = (char *)c->stack + c->stack_size;
+		/* The frames of the parked coroutine must stay. */
+		if (top - size + engine->page_size <= c->stack_live) {
+			c->stack = coro_stack_shrink(c->stack, c->stack_size,
+				&size, engine->page_size);
+			c->stack_size = size;
+		}
+	}
+	/* Only the fresh stacks are fully painted by the kernel. */
+	if (coro_stack_mode != CORO_STACK_FIXED &&
+	    c->stack_live != (char *)c->stack + c->stack_size)
+		coro_stack_paint(c->stack_live, coro_ctx_sp(&c->ctx));
+	return c;
+}
+
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size)
+{
+	struct coro *c = coro_engine_take(engine, stack_size);
+	if (c != NULL)
+		coro_engine_start(engine, c, func, func_arg);
+	return c;
+}
+
+/**
+ * Make sure the pool has at least @a count coroutines with a stack
+ * of at least the given size in its head, where the spawns look.
+ * The pooled ones which fit are moved to the head. The missing ones
+ * are allocated in a single slab - one malloc() for all the
+ * descriptors and one mmap() for all the stacks - and are put in
+ * the head too, so as the next spawns take them in order.
+ */
+static void
+coro_engine_reserve(struct coro_engine *engine, size_t count,
+	size_t stack_size)
+{
+	struct coro *c, *tmp;
+	size_t found = 0;
+	rlist_foreach_entry_safe(c, &engine->coros_pool, link, tmp) {
+		if (found == count)
+			return;
+		if (c->stack_size < stack_size)
+			continue;
+		rlist_move_entry(&engine->coros_pool, c, link);
+		++found;
+	}
+	if (found >= count)
+		return;
+	count -= found;
+	struct coro_slab *slab = malloc(sizeof(*slab) +
+		sizeof(slab->coros[0]) * count);
+	if (slab == NULL)
+		handle_error();
+	stack_size = coro_stack_size_fit(stack_size);
+	char *stacks = coro_stacks_new(count, &stack_size, engine->page_size);
+	if (stacks == NULL) {
+		/* The spawns will try one by one. */
+		free(slab);
+		return;
+	}
+	size_t step = stack_size + engine->page_size;
+	slab->stacks = stacks;
+	slab->stacks_size = step * count;
+	slab->count = count;
+	for (size_t i = count; i-- > 0;) {
+		c = &slab->coros[i];
+		coro_init(c);
+		c->slab = slab;
+		c->state = CORO_STATE_FINISHED;
+		c->func = NULL;
+		c->stack = stacks + step * i + engine->page_size;
+		c->stack_size = stack_size;
+		c->stack_live = (char *)c->stack + stack_size;
+		coro_ctx_create(&c->ctx, c->stack, stack_size, coro_body, c);
+		rlist_add_entry(&engine->coros_pool, c, link);
+	}
+	rlist_add_entry(&engine->slabs, slab, link);
+	engine->pool_count += count;
+	engine->coro_count += count;
+}
+
+/**
+ * Spawn @a count coroutines with the default stacks. All the
+ * coroutines which are not found in the pool are allocated in one
+ * slab.
+ */
+static void
+coro_engine_spawn_many(struct coro_engine *engine, size_t count,
+	coro_f func, void **func_args, struct coro **coros)
+{
+	coro_engine_reserve(engine, count, CORO_STACK_SIZE_DEFAULT);
+	for (size_t i = 0; i < count; ++i) {
+		coros[i] = coro_engine_spawn(engine, func,
+			func_args != NULL ? func_args[i] : NULL,
+			CORO_STACK_SIZE_DEFAULT);
+	}
+}
+
+static void
+coro_shared_stack_mt_error(void)
+{
+	printf("Error: shared stacks can't be used in multiple threads\n");
+	exit(-1);
+}
+
+/**
+ * Spawn a coroutine running on one of the engine's shared stacks.
+ * The stacks are allocated on the first use. The coroutine context
+ * is created when it gets its stack for the first time.
+ */
+static struct coro *
+coro_engine_spawn_shared(struct coro_engine *engine, coro_f func,
+	void *func_arg)
+{
+	struct coro *c;
+	if (engine->mt != NULL)
+		coro_shared_stack_mt_error();
+	++engine->shared_coro_count;
+	if (!rlist_empty(&engine->coros_shared_pool)) {
+		c = rlist_shift_entry(&engine->coros_shared_pool,
+			struct coro, link);
+		coro_engine_start(engine, c, func, func_arg);
+		return c;
+	}
+	if (engine->copy_stack == NULL) {
+		size_t size = CORO_COPY_STACK_SIZE;
+		if ((long)size < (long)SIGSTKSZ)
+			size = SIGSTKSZ;
+		engine->copy_stack = coro_stack_new(&size, engine->page_size);
+		if (engine->copy_stack == NULL)
+			handle_error();
+		engine->copy_stack_size = size;
+		coro_ctx_create(&engine->copy_ctx, engine->copy_stack, size,
+			coro_engine_copy_f, engine);
+	}
+	struct coro_shared_stack *stack =
+		&engine->shared_stacks[engine->shared_stack_next];
+	engine->shared_stack_next = (engine->shared_stack_next + 1) %
+		CORO_SHARED_STACK_COUNT;
+	if (stack->stack == NULL) {
+		stack->size = CORO_STACK_SIZE_DEFAULT;
+		stack->stack = coro_stack_new(&stack->size, engine->page_size);
+		if (stack->stack == NULL)
+			handle_error();
+	}
+	c = coro_alloc();
+	c->shared = stack;
+	++engine->coro_count;
+	coro_engine_start(engine, c, func, func_arg);
+	return c;
+}
+
+/**
+ * Wait for the coroutine end when it can finish on another thread
+ * any moment. This one is marked suspended before checking the
+ * state, so the wakeup from the finished one can't be lost.
+ */
+static struct coro_engine *
+coro_engine_join_mt(struct coro_engine *engine, struct coro *coro)
+{
+	struct coro *this = engine->this;
+	assert(this != NULL);
+	while (true) {
+		coro_engine_set_state(engine, this, CORO_STATE_SUSPENDED);
+		if (coro_engine_get_state(engine, coro) != CORO_STATE_FINISHED) {
+			coro_engine_event(engine, CORO_EVENT_SUSPEND, this);
+			coro_engine_resume_next(engine);
+			engine = coro_engine_this_thread();
+			continue;
+		}
+		enum coro_state old = CORO_STATE_SUSPENDED;
+		if (!__atomic_compare_exchange_n(&this->state, &old,
+			CORO_STATE_RUNNING, false, __ATOMIC_SEQ_CST,
+			__ATOMIC_SEQ_CST)) {
+			/* Already woken up and scheduled. Let it run. */
+			coro_engine_resume_next(engine);
+			engine = coro_engine_this_thread();
+		}
+		return engine;
+	}
+}
+
+/**
+ * Put the finished coroutine into the pool for reuse.
+ * @return The result of the coroutine function.
+ */
+static void *
+coro_engine_release(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->state == CORO_STATE_FINISHED);
+	coro_engine_event(engine, CORO_EVENT_JOIN, coro);
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	coro_specific_clear(coro);
+	assert(rlist_empty(&coro->link));
+	if (coro->shared == NULL) {
+		rlist_add_entry(&engine->coros_pool, coro, link);
+		++engine->pool_count;
+	} else {
+		assert(engine->shared_coro_count > 0);
+		--engine->shared_coro_count;
+		rlist_add_entry(&engine->coros_shared_pool, coro, link);
+	}
+	return ret;
+}
+
+static void *
+coro_engine_join(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->joiner == NULL);
+	if (engine->mt == NULL) {
+		coro->joiner = engine->this;
+		while (coro->state == CORO_STATE_RUNNING ||
+			coro->state == CORO_STATE_SUSPENDED)
+			coro_engine_suspend(engine);
+	} else {
+		__atomic_store_n(&coro->joiner, engine->this, __ATOMIC_SEQ_CST);
+		engine = coro_engine_join_mt(engine, coro);
+	}
+	assert(coro->joiner == engine->this);
+	coro->joiner = NULL;
+	return coro_engine_release(engine, coro);
+}
+
+/** Coroutine function of the generators. */
+static void *
+coro_gen_body_f(void *arg)
+{
+	struct coro_gen *gen = arg;
+	gen->func(gen->func_arg);
+	gen->is_done = true;
+	return NULL;
+}
+
+static struct coro_gen *
+coro_engine_generator_new(struct coro_engine *engine, coro_gen_f func,
+	void *func_arg)
+{
+	struct coro_gen *gen = malloc(sizeof(*gen));
+	if (gen == NULL)
+		handle_error();
+	gen->func = func;
+	gen->func_arg = func_arg;
+	gen->consumer = NULL;
+	gen->value = NULL;
+	gen->is_done = false;
+	gen->coro = coro_engine_take(engine, CORO_STACK_SIZE_DEFAULT);
+	if (gen->coro == NULL)
+		handle_error();
+	gen->coro->gen = gen;
+	coro_engine_prepare(engine, gen->coro, coro_gen_body_f, gen);
+	return gen;
+}
+
+static bool
+coro_engine_gen_next(struct coro_engine *engine, struct coro_gen *gen,
+	void **value)
+{
+	if (gen->is_done)
+		return false;
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	assert(gen->consumer == NULL);
+	assert(this != gen->coro);
+	/*
+	 * The consumer stays running, it just lends the CPU to the
+	 * generator until the value is ready.
+	 */
+	gen->consumer = this;
+	coro_engine_switch_to(engine, gen->coro);
+	gen->consumer = NULL;
+	if (gen->is_done)
+		return false;
+	*value = gen->value;
+	return true;
+}
+
+static void
+coro_engine_gen_yield(struct coro_engine *engine, void *value)
+{
+	struct coro *this = engine->this;
+	if (this == NULL || this->gen == NULL) {
+		printf("Error: coro_gen_yield() outside of a generator\n");
+		exit(-1);
+	}
+	struct coro_gen *gen = this->gen;
+	assert(gen->consumer != NULL);
+	gen->value = value;
+	coro_engine_switch_to(engine, gen->consumer);
+}
+
+static void
+coro_engine_generator_delete(struct coro_engine *engine, struct coro_gen *gen)
+{
+	/* The function frames would be lost with the stack. */
+	assert(gen->is_done);
+	assert(gen->consumer == NULL);
+	gen->coro->gen = NULL;
+	coro_engine_release(engine, gen->coro);
+	free(gen);
+}
+
+static void *
+coro_sched_mt_worker_f(void *arg)
+{
+	struct coro_engine *engine = arg;
+	thread_engine = engine;
+	coro_engine_loop(engine);
+	return NULL;
+}
+
+/**
+ * Wait in the queue until the resource is handed over. The queue
+ * lock must be taken, it is released inside.
+ */
+static void
+coro_engine_wait_grant(struct coro_engine *engine, struct rlist *waiters,
+	bool *lock)
+{
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	struct coro_waiter *waiter = &this->waiter;
+	waiter->coro = this;
+	waiter->is_granted = 0;
+	rlist_add_tail_entry(waiters, waiter, link);
+	coro_engine_unlock(engine, lock);
+	coro_engine_wait_flag(engine, &waiter->is_granted);
+}
+
+/**
+ * Hand the resource over to the first waiter. The queue lock must
+ * be taken. The waiter must be woken up after the lock release.
+ * @return The waiter coroutine or NULL if there are no waiters.
+ */
+static struct coro *
+coro_waiters_grant_first(struct rlist *waiters)
+{
+	if (rlist_empty(waiters))
+		return NULL;
+	struct coro_waiter *waiter = rlist_shift_entry(waiters,
+		struct coro_waiter, link);
+	/* The waiter can leave right after the grant. */
+	struct coro *coro = waiter->coro;
+	__atomic_store_n(&waiter->is_granted, 1, __ATOMIC_SEQ_CST);
+	return coro;
+}
+
+/** All the traces recorded since the start, to be dumped together. */
+static struct {
+	/** True if the new engines should record a trace. */
+	bool is_enabled;
+	/** Max number of the events kept per engine. */
+	size_t capacity;
+	/** Where to dump the traces on destroy. NULL - don't. */
+	char *path;
+	struct coro_trace **traces;
+	int count;
+} coro_trace_log;
+
+/** Create a trace buffer. Only the main thread can do that. */
+static struct coro_trace *
+coro_trace_new(const char *name)
+{
+	struct coro_trace *trace = malloc(sizeof(*trace));
+	if (trace == NULL)
+		handle_error();
+	trace->head = 0;
+	trace->mask = coro_trace_log.capacity - 1;
+	trace->tid = coro_trace_log.count;
+	snprintf(trace->name, sizeof(trace->name), "%s", name);
+	trace->events = malloc(sizeof(trace->events[0]) *
+		coro_trace_log.capacity);
+	if (trace->events == NULL)
+		handle_error();
+	int count = coro_trace_log.count + 1;
+	coro_trace_log.traces = realloc(coro_trace_log.traces,
+		sizeof(coro_trace_log.traces[0]) * count);
+	if (coro_trace_log.traces == NULL)
+		handle_error();
+	coro_trace_log.traces[coro_trace_log.count] = trace;
+	coro_trace_log.count = count;
+	return trace;
+}
+
+static void
+coro_trace_log_destroy(void)
+{
+	for (int i = 0; i < coro_trace_log.count; ++i) {
+		free(coro_trace_log.traces[i]->events);
+		free(coro_trace_log.traces[i]);
+	}
+	free(coro_trace_log.traces);
+	free(coro_trace_log.path);
+	memset(&coro_trace_log, 0, sizeof(coro_trace_log));
+}
+
+static void
+coro_trace_event_name(uint64_t coro_id, char *buf, size_t size)
+{
+	if (coro_id == 0)
+		snprintf(buf, size, "sched");
+	else
+		snprintf(buf, size, "coro %llu", (unsigned long long)coro_id);
+}
+
+/**
+ * Write the events of one trace in Chrome Trace Event format. A
+ * resume becomes a slice lasting until the next resume on the same
+ * thread, the other events are instant.
+ */
+static void
+coro_trace_write(struct coro_trace *trace, FILE *f, double ns_per_cycle,
+	bool *is_first)
+{
+	uint64_t capacity = trace->mask + 1;
+	uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	uint64_t begin = head > capacity ? head - capacity : 0;
+	size_t count = head - begin;
+	struct coro_trace_event *events = malloc(sizeof(events[0]) *
+		(count + 1));
+	if (events == NULL)
+		handle_error();
+	for (uint64_t i = begin; i < head; ++i)
+		events[i - begin] = trace->events[i & trace->mask];
+	/*
+	 * Skip the events overwritten during the copying, and the one
+	 * at the new head, which a writer can be rewriting before it
+	 * publishes the head.
+	 */
+	uint64_t new_head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	size_t skip = 0;
+	if (new_head >= capacity && new_head - capacity + 1 > begin)
+		skip = new_head - capacity + 1 - begin;
+	if (skip > count)
+		skip = count;
+
+	int pid = getpid();
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", *is_first ? "" : ",",
+		pid, trace->tid, trace->name);
+	*is_first = false;
+	char name[32];
+	for (size_t i = skip; i < count; ++i) {
+		struct coro_trace_event *e = &events[i];
+		double ts = (e->cycles - coro_cycles_start) * ns_per_cycle /
+			1000;
+		coro_trace_event_name(e->coro_id, name, sizeof(name));
+		if (e->type != CORO_EVENT_RESUME) {
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+				"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+				"\"args\":{\"coro\":\"%s\"}}",
+				coro_event_type_strs[e->type], pid, trace->tid,
+				ts, name);
+			continue;
+		}
+		size_t end = i + 1;
+		while (end < count && events[end].type != CORO_EVENT_RESUME)
+			++end;
+		if (end == count)
+			--end;
+		double dur = (events[end].cycles - e->cycles) * ns_per_cycle /
+			1000;
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+			"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", name, pid,
+			trace->tid, ts, dur);
+	}
+	free(events);
+}
+
+//////////////////////////////////////////////////////////////////
+
+struct coro_engine *
+coro_engine_new(void)
+{
+	assert(thread_engine == NULL);
+	coro_cycles_calibrate_start();
+	struct coro_engine *engine = malloc(sizeof(*engine));
+	if (engine == NULL)
+		handle_error();
+	coro_engine_create(engine);
+	engine->inbox = &engine->remote_inbox;
+	__atomic_add_fetch(&coro_engine_count, 1, __ATOMIC_RELAXED);
+	thread_engine = engine;
+	return engine;
+}
+
+void
+coro_engine_run(struct coro_engine *engine)
+{
+	assert(engine == thread_engine);
+	coro_engine_loop(engine);
+}
+
+void
+coro_engine_delete(struct coro_engine *engine)
+{
+	assert(engine == thread_engine);
+	coro_engine_destroy(engine);
+	free(engine);
+	thread_engine = NULL;
+	/* The last engine takes the helper threads with it. */
+	if (__atomic_sub_fetch(&coro_engine_count, 1, __ATOMIC_RELAXED) == 0)
+		coro_io_threads_stop();
+}
+
+struct coro_mailbox *
+coro_mailbox_new(struct coro_engine *engine, size_t capacity)
+{
+	struct coro_mailbox *box = calloc(1, sizeof(*box));
+	if (box == NULL)
+		handle_error();
+	size_t pow2 = 1;
+	while (pow2 < capacity)
+		pow2 *= 2;
+	box->msgs = malloc(sizeof(box->msgs[0]) * pow2);
+	if (box->msgs == NULL)
+		handle_error();
+	box->mask = pow2 - 1;
+	struct coro_inbox *inbox = &engine->remote_inbox;
+	box->inbox = inbox;
+	rlist_create(&box->link);
+	coro_inbox_open(inbox);
+	/* The receiver doesn't stop while the mailbox is open. */
+	__atomic_add_fetch(&inbox->wait_count, 1, __ATOMIC_SEQ_CST);
+	struct coro_mailbox *next = __atomic_load_n(&inbox->new_mailboxes,
+		__ATOMIC_RELAXED);
+	do {
+		box->new_next = next;
+	} while (!__atomic_compare_exchange_n(&inbox->new_mailboxes, &next,
+		box, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	coro_inbox_kick(inbox);
+	return box;
+}
+
+int
+coro_mailbox_send(struct coro_mailbox *box, coro_mailbox_f func, void *arg)
+{
+	assert(!box->is_closed);
+	size_t tail = box->tail;
+	if (tail - box->head_cache > box->mask) {
+		box->head_cache = __atomic_load_n(&box->head, __ATOMIC_SEQ_CST);
+		if (tail - box->head_cache > box->mask) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	struct coro_mailbox_msg *msg = &box->msgs[tail & box->mask];
+	msg->func = func;
+	msg->arg = arg;
+	__atomic_store_n(&box->tail, tail + 1, __ATOMIC_SEQ_CST);
+	coro_inbox_kick(box->inbox);
+	return 0;
+}
+
+void
+coro_mailbox_close(struct coro_mailbox *box)
+{
+	struct coro_inbox *inbox = box->inbox;
+	__atomic_store_n(&box->is_closed, true, __ATOMIC_SEQ_CST);
+	/* The box can be freed by the receiver right away. */
+	coro_inbox_kick(inbox);
+}
+
+void
+coro_sched_init(void)
+{
+	coro_engine_new();
+}
+
+void
+coro_sched_run(void)
+{
+	coro_engine_run(thread_engine);
+}
+
+void
+coro_sched_run_mt(int thread_count)
+{
+	if (thread_count <= 1) {
+		coro_sched_run();
+		return;
+	}
+	coro_is_mt_used = true;
+	struct coro_engine *home = thread_engine;
+	struct coro_sched_mt mt;
+	mt.workers = malloc(sizeof(mt.workers[0]) * thread_count);
+	mt.worker_count = thread_count;
+	mt.sleeper_count = 0;
+	mt.is_done = false;
+	pthread_mutex_init(&mt.idle_mutex, NULL);
+	pthread_cond_init(&mt.idle_cond, NULL);
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_engine *w = &mt.workers[i];
+		coro_engine_create(w);
+		w->mt = &mt;
+		w->worker_id = i;
+		w->home = home;
+		if (coro_trace_log.is_enabled) {
+			char name[32];
+			snprintf(name, sizeof(name), "worker %d", i);
+			w->trace = coro_trace_new(name);
+		}
+	}
+	/*
+	 * The current thread becomes the first worker and gets all
+	 * the already scheduled coroutines. The others steal them.
+	 */
+	assert(home->this == NULL);
+	assert(coro_timer_wheel_count(&home->timers) == 0);
+	assert(home->fd_wait_count == 0);
+	if (home->shared_coro_count != 0)
+		coro_shared_stack_mt_error();
+	struct coro_engine *first = &mt.workers[0];
+	first->inbox = home->inbox;
+	for (int p = 0; p < CORO_PRIORITY_COUNT; ++p) {
+		rlist_splice_tail(&first->coros_running_next[p],
+			&home->coros_running_next[p]);
+		first->next_counts[p] = home->next_counts[p];
+		home->next_counts[p] = 0;
+	}
+	first->next_count = home->next_count;
+	home->next_count = 0;
+
+	pthread_t *threads = malloc(sizeof(threads[0]) * thread_count);
+	for (int i = 1; i < thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, coro_sched_mt_worker_f,
+			&mt.workers[i]) != 0)
+			handle_error();
+	}
+	coro_sched_mt_worker_f(first);
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	thread_engine = home;
+	free(threads);
+
+	/* The coroutines stay valid and return to the calling thread. */
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_engine *w = &mt.workers[i];
+		assert(w->this == NULL);
+		assert(rlist_empty(&w->coros_running_now));
+		assert(w->next_count == 0);
+		assert(coro_timer_wheel_count(&w->timers) == 0);
+		assert(w->fd_wait_count == 0);
+		assert(w->io_wait_count == 0);
+		if (w->uring != NULL)
+			coro_uring_delete(w->uring);
+		if (w->epoll_fd >= 0)
+			close(w->epoll_fd);
+		rlist_splice_tail(&home->coros_pool, &w->coros_pool);
+		home->pool_count += w->pool_count;
+		rlist_splice_tail(&home->slabs, &w->slabs);
+		home->coro_count += w->coro_count;
+		struct coro_sched_stats *stats = &home->stats;
+		stats->switch_count += w->stats.switch_count;
+		stats->yield_count += w->stats.yield_count;
+		stats->suspend_count += w->stats.suspend_count;
+		stats->wakeup_count += w->stats.wakeup_count;
+		stats->preempt_count += w->stats.preempt_count;
+		if (w->stats.next_max > stats->next_max)
+			stats->next_max = w->stats.next_max;
+	}
+	pthread_cond_destroy(&mt.idle_cond);
+	pthread_mutex_destroy(&mt.idle_mutex);
+	free(mt.workers);
+}
+
+void
+coro_sched_destroy(void)
+{
+	coro_engine_delete(thread_engine);
+	if (coro_trace_log.path != NULL &&
+	    coro_trace_dump(coro_trace_log.path) != 0)
+		handle_error();
+	coro_trace_log_destroy();
+}
+
+struct coro *
+coro_this(void)
+{
+	if (thread_engine == NULL)
+		return NULL;
+	return thread_engine->this;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_engine_spawn(thread_engine, func, func_arg,
+		coro_stack_size_for(func));
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
+{
+	if (stack_size == 0)
+		stack_size = CORO_STACK_SIZE_DEFAULT;
+	return coro_engine_spawn(thread_engine, func, func_arg,
+		stack_size);
+}
+
+void
+coro_new_many(size_t count, coro_f func, void **func_args,
+	struct coro **coros)
+{
+	coro_engine_spawn_many(thread_engine, count, func, func_args, coros);
+}
+
+void
+coro_sched_reserve(size_t count)
+{
+	coro_engine_reserve(thread_engine, count, CORO_STACK_SIZE_DEFAULT);
+}
+
+void *
+coro_join(struct coro *coro)
+{
+	return coro_engine_join(thread_engine, coro);
+}
+
+void
+coro_suspend(void)
+{
+	coro_engine_suspend(thread_engine);
+}
+
+void
+coro_yield(void)
+{
+	coro_engine_yield(thread_engine);
+}
+
+void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(thread_engine, coro);
+}
+
+void
+coro_wakeup_and_switch(struct coro *coro)
+{
+	coro_engine_wakeup_and_switch(thread_engine, coro);
+}
+
+int
+coro_sched_set_preempt(double slice)
+{
+#if LIBCORO_USE_PREEMPT
+	static bool is_handler_set = false;
+	if (slice > 0 && !is_handler_set) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = coro_preempt_handler;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGALRM, &sa, NULL) != 0)
+			return -1;
+		is_handler_set = true;
+	}
+	uint64_t slice_ns = 0;
+	if (slice > 0) {
+		slice_ns = (uint64_t)(slice * 1000000000);
+		if (slice_ns == 0)
+			slice_ns = 1;
+	}
+	coro_preempt_slice_ns = slice_ns;
+	return 0;
+#else
+	(void)slice;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void
+coro_check_preempt(void)
+{
+	coro_engine_check_preempt(thread_engine);
+}
+
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *))
+{
+	unsigned count = __atomic_load_n(&coro_key_count, __ATOMIC_RELAXED);
+	do {
+		if (count >= CORO_KEYS_MAX) {
+			errno = EAGAIN;
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&coro_key_count, &count,
+		count + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	/*
+	 * A finishing coroutine can see the new key before its
+	 * destructor is set. Harmless - nobody has a value for it yet.
+	 */
+	coro_key_destructors[count] = destructor;
+	*key = count;
+	return 0;
+}
+
+void *
+coro_getspecific(coro_key_t key)
+{
+	struct coro *c = thread_engine->this;
+	assert(c != NULL && key < CORO_KEYS_MAX);
+	if (key < CORO_KEYS_INLINE)
+		return c->specific[key];
+	if (c->specific_ext == NULL)
+		return NULL;
+	return c->specific_ext[key - CORO_KEYS_INLINE];
+}
+
+int
+coro_setspecific(coro_key_t key, const void *value)
+{
+	struct coro *c = thread_engine->this;
+	assert(c != NULL);
+	if (key >= __atomic_load_n(&coro_key_count, __ATOMIC_ACQUIRE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (key < CORO_KEYS_INLINE) {
+		c->specific[key] = (void *)value;
+		return 0;
+	}
+	if (c->specific_ext == NULL) {
+		c->specific_ext = calloc(CORO_KEYS_MAX - CORO_KEYS_INLINE,
+			sizeof(c->specific_ext[0]));
+		if (c->specific_ext == NULL)
+			return -1;
+	}
+	c->specific_ext[key - CORO_KEYS_INLINE] = (void *)value;
+	return 0;
+}
+
+void
+coro_sched_set_stack_mode(enum coro_stack_mode mode)
+{
+	coro_stack_mode = mode;
+}
+
+size_t
+coro_stack_usage(const struct coro *coro)
+{
+	if (coro->shared != NULL)
+		return 0;
+	if (coro_engine_get_state(thread_engine, (struct coro *)coro) ==
+	    CORO_STATE_FINISHED)
+		return coro->stack_usage;
+	return coro_stack_used(coro->stack, coro->stack_size,
+		thread_engine->page_size);
+}
+
+void
+coro_set_priority(struct coro *coro, enum coro_priority priority)
+{
+	assert(priority >= 0 && priority < CORO_PRIORITY_COUNT);
+	coro->priority = priority;
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	uint64_t deadline_ns = coro_clock_ns();
+	if (timeout > 0)
+		deadline_ns += (uint64_t)(timeout * 1000000000);
+	return coro_engine_suspend_until(thread_engine, deadline_ns);
+}
+
+void
+coro_sleep(double duration)
+{
+	uint64_t deadline_ns = coro_clock_ns();
+	if (duration > 0)
+		deadline_ns += (uint64_t)(duration * 1000000000);
+	/* The explicit wakeups don't interrupt the sleep. */
+	while (coro_engine_suspend_until(coro_engine_this_thread(),
+		deadline_ns))
+		continue;
+}
+
+int
+coro_wait_fd(int fd, int events)
+{
+	return coro_engine_wait_fd(thread_engine, fd, events);
+}
+
+int
+coro_close(int fd)
+{
+	return coro_engine_close(thread_engine, fd);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size, off_t offset)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_READ;
+	io.fd = fd;
+	io.buf = buf;
+	io.size = size;
+	io.offset = offset;
+	return coro_engine_io(thread_engine, &io);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size, off_t offset)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_WRITE;
+	io.fd = fd;
+	io.buf = (void *)buf;
+	io.size = size;
+	io.offset = offset;
+	return coro_engine_io(thread_engine, &io);
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_size)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_ACCEPT;
+	io.fd = fd;
+	io.buf = addr;
+	io.addr_size = addr_size;
+	return coro_engine_io(thread_engine, &io);
+}
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_size)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_CONNECT;
+	io.fd = fd;
+	io.buf = (void *)addr;
+	io.size = addr_size;
+	return coro_engine_io(thread_engine, &io);
+}
+
+int
+coro_fsync(int fd)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_FSYNC;
+	io.fd = fd;
+	return coro_engine_io(thread_engine, &io);
+}
+
+void
+coro_suspend_remote(void)
+{
+	coro_engine_suspend_remote(thread_engine);
+}
+
+void
+coro_wakeup_remote(struct coro *coro)
+{
+	__atomic_store_n(&coro->is_remote_pending, 1, __ATOMIC_SEQ_CST);
+	coro_inbox_push(&coro->home->remote_inbox, coro);
+}
+
+struct coro *
+coro_new_shared(coro_f func, void *func_arg)
+{
+	return coro_engine_spawn_shared(thread_engine, func, func_arg);
+}
+
+struct coro_gen *
+coro_generator_new(coro_gen_f func, void *func_arg)
+{
+	return coro_engine_generator_new(thread_engine, func, func_arg);
+}
+
+bool
+coro_gen_next(struct coro_gen *gen, void **value)
+{
+	return coro_engine_gen_next(thread_engine, gen, value);
+}
+
+void
+coro_gen_yield(void *value)
+{
+	coro_engine_gen_yield(thread_engine, value);
+}
+
+void
+coro_generator_delete(struct coro_gen *gen)
+{
+	coro_engine_generator_delete(thread_engine, gen);
+}
+
+void
+coro_sched_stats(struct coro_sched_stats *stats)
+{
+	*stats = thread_engine->stats;
+}
+
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats)
+{
+	stats->switch_count = coro->switch_count;
+	stats->preempt_count = coro->preempt_count;
+	stats->stack_size = coro->stack_size;
+	uint64_t run_cycles = coro->run_cycles;
+	struct coro_engine *engine = thread_engine;
+	/* The current coroutine's time is not accounted yet. */
+	if (!LIBCORO_NO_RUN_TIME && coro == engine->this)
+		run_cycles += coro_cycles() - engine->run_start;
+	stats->run_time_ns = coro_cycles_to_ns(run_cycles);
+}
+
+void
+coro_trace_start(size_t capacity, const char *path)
+{
+	assert(!coro_trace_log.is_enabled);
+	size_t pow2 = 1;
+	while (pow2 < capacity)
+		pow2 *= 2;
+	coro_trace_log.capacity = pow2;
+	coro_trace_log.is_enabled = true;
+	free(coro_trace_log.path);
+	coro_trace_log.path = path == NULL ? NULL : strdup(path);
+	thread_engine->trace = coro_trace_new("main");
+}
+
+void
+coro_trace_stop(void)
+{
+	coro_trace_log.is_enabled = false;
+	thread_engine->trace = NULL;
+}
+
+int
+coro_trace_dump(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	double ns_per_cycle = coro_ns_per_cycle();
+	bool is_first = true;
+	fprintf(f, "{\"traceEvents\":[");
+	for (int i = 0; i < coro_trace_log.count; ++i) {
+		coro_trace_write(coro_trace_log.traces[i], f, ns_per_cycle,
+			&is_first);
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+}
+
+void
+coro_mutex_create(struct coro_mutex *mutex)
+{
+	mutex->lock = false;
+	mutex->is_locked = false;
+	rlist_create(&mutex->waiters);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *mutex)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &mutex->lock);
+	if (!mutex->is_locked) {
+		mutex->is_locked = true;
+		coro_engine_unlock(engine, &mutex->lock);
+		coro_engine_check_preempt(engine);
+		return;
+	}
+	coro_engine_wait_grant(engine, &mutex->waiters, &mutex->lock);
+	assert(mutex->is_locked);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *mutex)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &mutex->lock);
+	bool ok = !mutex->is_locked;
+	mutex->is_locked = true;
+	coro_engine_unlock(engine, &mutex->lock);
+	return ok;
+}
+
+static void
+coro_engine_mutex_unlock(struct coro_engine *engine, struct coro_mutex *mutex)
+{
+	coro_engine_lock(engine, &mutex->lock);
+	assert(mutex->is_locked);
+	struct coro *next = coro_waiters_grant_first(&mutex->waiters);
+	if (next == NULL)
+		mutex->is_locked = false;
+	coro_engine_unlock(engine, &mutex->lock);
+	if (next != NULL)
+		coro_engine_wakeup(engine, next);
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex)
+{
+	coro_engine_mutex_unlock(thread_engine, mutex);
+}
+
+void
+coro_cond_create(struct coro_cond *cond)
+{
+	cond->lock = false;
+	rlist_create(&cond->waiters);
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &cond->lock);
+	/*
+	 * The mutex is unlocked after joining the queue, so a signal
+	 * sent after that can't be missed.
+	 */
+	struct coro *this = coro_engine_this_to_suspend(engine);
+	struct coro_waiter *waiter = &this->waiter;
+	waiter->coro = this;
+	waiter->is_granted = 0;
+	rlist_add_tail_entry(&cond->waiters, waiter, link);
+	coro_engine_unlock(engine, &cond->lock);
+	coro_engine_mutex_unlock(engine, mutex);
+	coro_engine_wait_flag(engine, &waiter->is_granted);
+	coro_mutex_lock(mutex);
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &cond->lock);
+	struct coro *next = coro_waiters_grant_first(&cond->waiters);
+	coro_engine_unlock(engine, &cond->lock);
+	if (next != NULL)
+		coro_engine_wakeup(engine, next);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	struct coro_engine *engine = thread_engine;
+	struct rlist waiters;
+	rlist_create(&waiters);
+	coro_engine_lock(engine, &cond->lock);
+	rlist_splice(&waiters, &cond->waiters);
+	coro_engine_unlock(engine, &cond->lock);
+	struct coro *next;
+	while ((next = coro_waiters_grant_first(&waiters)) != NULL)
+		coro_engine_wakeup(engine, next);
+}
+
+void
+coro_sem_create(struct coro_sem *sem, unsigned count)
+{
+	sem->lock = false;
+	sem->count = count;
+	rlist_create(&sem->waiters);
+}
+
+void
+coro_sem_wait(struct coro_sem *sem)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &sem->lock);
+	if (sem->count > 0) {
+		--sem->count;
+		coro_engine_unlock(engine, &sem->lock);
+		coro_engine_check_preempt(engine);
+		return;
+	}
+	coro_engine_wait_grant(engine, &sem->waiters, &sem->lock);
+}
+
+bool
+coro_sem_trywait(struct coro_sem *sem)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &sem->lock);
+	bool ok = sem->count > 0;
+	if (ok)
+		--sem->count;
+	coro_engine_unlock(engine, &sem->lock);
+	return ok;
+}
+
+void
+coro_sem_post(struct coro_sem *sem)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &sem->lock);
+	struct coro *next = coro_waiters_grant_first(&sem->waiters);
+	if (next == NULL)
+		++sem->count;
+	coro_engine_unlock(engine, &sem->lock);
+	if (next != NULL)
+		coro_engine_wakeup(engine, next);
+}
+
+void
+coro_wait_group_create(struct coro_wait_group *group)
+{
+	group->lock = false;
+	group->count = 0;
+	rlist_create(&group->waiters);
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *group, unsigned count)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &group->lock);
+	group->count += count;
+	coro_engine_unlock(engine, &group->lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *group)
+{
+	struct coro_engine *engine = thread_engine;
+	struct rlist waiters;
+	rlist_create(&waiters);
+	coro_engine_lock(engine, &group->lock);
+	assert(group->count > 0);
+	if (--group->count == 0)
+		rlist_splice(&waiters, &group->waiters);
+	coro_engine_unlock(engine, &group->lock);
+	struct coro *next;
+	while ((next = coro_waiters_grant_first(&waiters)) != NULL)
+		coro_engine_wakeup(engine, next);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *group)
+{
+	struct coro_engine *engine = thread_engine;
+	coro_engine_lock(engine, &group->lock);
+	if (group->count == 0) {
+		coro_engine_unlock(engine, &group->lock);
+		coro_engine_check_preempt(engine);
+		return;
+	}
+	coro_engine_wait_grant(engine, &group->waiters, &group->lock);
 }
@@ -1,11 +1,21 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
 
-/** Initialize the coroutines engine. */
+struct coro_engine;
+
+/**
+ * Initialize the coroutines engine of the current thread. Same as
+ * coro_engine_new(), the coro_sched_*() functions work with the
+ * current thread's engine.
+ */
 void
 coro_sched_init(void);
 
@@ -16,6 +26,23 @@ coro_sched_init(void);
 void
 coro_sched_run(void);
 
+/**
+ * Same as coro_sched_run(), but the coroutines are processed by
+ * the given number of threads, including the current one. Each
+ * thread has its own run queue and steals the runnable coroutines
+ * from the others when idle. All the functions of this API can be
+ * used by the coroutines on any of the threads. The function
+ * returns when there are no runnable coroutines left in any of the
+ * threads. The not finished coroutines return to the current
+ * thread.
+ *
+ * Note, that in this mode a coroutine can be woken up not only by
+ * the code which it waits for. It should check its condition again
+ * after coro_suspend().
+ */
+void
+coro_sched_run_mt(int thread_count);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -23,6 +50,69 @@ coro_sched_run(void);
 void
 coro_sched_destroy(void);
 
+/**
+ * Create an engine for the current thread. Each thread can have
+ * its own engine, they share nothing. The coroutines created by
+ * the thread belong to its engine and are only run by it. For
+ * example, a thread per CPU core can run an engine each, with the
+ * data sharded between them, and talk to each other only through
+ * the mailboxes.
+ */
+struct coro_engine *
+coro_engine_new(void);
+
+/**
+ * Run the coroutines of the engine while there are any runnable
+ * ones, or while any mailboxes to it are open. Can only be called
+ * by the engine's thread.
+ */
+void
+coro_engine_run(struct coro_engine *engine);
+
+/**
+ * Destroy the engine of the current thread. All its coros must be
+ * finished and its mailboxes closed by now.
+ */
+void
+coro_engine_delete(struct coro_engine *engine);
+
+/**
+ * Closure sent to an engine through a mailbox. It is called by the
+ * engine's scheduler between the coroutines, so it must not
+ * suspend, but it can create coroutines and wake them up.
+ */
+typedef void (*coro_mailbox_f)(void *arg);
+
+struct coro_mailbox;
+
+/**
+ * Open a mailbox to the engine, with room for at least the given
+ * number of messages. It has a single sender - one thread, or the
+ * coroutines of one engine. The engine keeps running while the
+ * mailbox is open.
+ */
+struct coro_mailbox *
+coro_mailbox_new(struct coro_engine *engine, size_t capacity);
+
+/**
+ * Send a closure to the engine of the mailbox. The messages are
+ * received in the order of sending. The receiver is signaled only
+ * when it is blocked, a busy one just picks them up on its next
+ * iteration.
+ * @retval 0 Success.
+ * @retval -1 The mailbox is full, errno is EAGAIN.
+ */
+int
+coro_mailbox_send(struct coro_mailbox *box, coro_mailbox_f func, void *arg);
+
+/**
+ * Close the mailbox after the last message. The receiver runs the
+ * already sent messages and frees the mailbox, so it must not be
+ * used by the sender anymore.
+ */
+void
+coro_mailbox_close(struct coro_mailbox *box);
+
 /** Get the currently working coroutine. */
 struct coro *
 coro_this(void);
@@ -34,10 +124,49 @@ coro_this(void);
  *
  * Whatever the callback function returns, will be returned from
  * coro_join().
+ *
+ * Each stack with its guard page takes 2 memory mappings, so the
+ * number of the coroutines with their own stacks is limited by
+ * vm.max_map_count / 2 - about 32k with the default 65530. The
+ * coroutines of coro_new_shared() don't have such a limit.
+ * @retval NULL Error, errno is set. ENOMEM when the stack can't
+ *     be mapped.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but the coroutine stack has at least the
+ * given size in bytes. 0 means the default size. The stack memory
+ * is committed lazily, only the touched pages consume RAM. Stack
+ * overflow is caught by a guard page and crashes the process
+ * instead of corrupting the memory. Fails the same as coro_new().
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Create @a count coroutines at once, all running @a func. The i-th
+ * one gets @a func_args[i] as the argument, or NULL if @a func_args
+ * is NULL. The coroutines are returned in @a coros. Those which
+ * can't be taken from the pool of the joined ones are allocated
+ * together in one slab, much cheaper than one by one. If the slab
+ * can't be mapped, they are created one by one, and those which
+ * fail like coro_new() are NULL in @a coros.
+ */
+void
+coro_new_many(size_t count, coro_f func, void **func_args,
+	struct coro **coros);
+
+/**
+ * Make sure at least @a count coroutines with the default stack can
+ * be created without any allocations. The pooled coroutines with
+ * smaller stacks don't count. Does nothing if the stacks can't be
+ * mapped.
+ */
+void
+coro_sched_reserve(size_t count);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -69,3 +198,380 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Same as coro_wakeup(), but the woken up coroutine runs right
+ * away, ahead of all the other runnable ones, and the current one
+ * is scheduled as if it yielded. It saves a whole iteration of the
+ * scheduler in a request-response exchange between coroutines when
+ * many others are runnable. If the coroutine is not suspended, it
+ * is a nop. Called not by a coroutine, works as coro_wakeup().
+ */
+void
+coro_wakeup_and_switch(struct coro *coro);
+
+/**
+ * Turn on the preemption with the given time slice in seconds, or
+ * turn it off with 0. It takes effect with the next start of the
+ * scheduler. Each scheduler thread gets a SIGALRM tick per @a slice
+ * of its CPU time. A coroutine which has got a tick while running
+ * is yielded at the next safe point - coro_check_preempt(), or a
+ * lock or a wait of the synchronization primitives even when it
+ * doesn't block. coro_wakeup(), the unlocks, the posts and the
+ * signals never switch, so as the caller could keep using the
+ * object after them. The coroutines are never interrupted anywhere
+ * else.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. ENOSYS when not supported.
+ */
+int
+coro_sched_set_preempt(double slice);
+
+/** Max number of the coroutine-local keys. */
+#define CORO_KEYS_MAX 128
+
+/** Key of a coroutine-local value. */
+typedef unsigned coro_key_t;
+
+/**
+ * Create a key for the coroutine-local values, like
+ * pthread_key_create() does for the threads. All the coroutines
+ * have NULL for a new key. If @a destructor is not NULL, it is
+ * called with the not NULL value of the key when the coroutine
+ * function returns. The keys are never deleted.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EAGAIN when out of the keys.
+ */
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *));
+
+/**
+ * Get the current coroutine's value of the key. The first 8 keys
+ * are stored right in the coroutine, so the access costs about the
+ * same as of a thread-local variable. The other keys need one more
+ * indirection.
+ */
+void *
+coro_getspecific(coro_key_t key);
+
+/**
+ * Set the current coroutine's value of the key. All the values are
+ * cleared when the coroutine is joined.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EINVAL for a not created key.
+ */
+int
+coro_setspecific(coro_key_t key, const void *value);
+
+enum coro_stack_mode {
+	/** All the coroutines get the requested stack sizes. */
+	CORO_STACK_FIXED,
+	/**
+	 * The stacks are painted at spawn, and the usage is measured
+	 * when a coroutine finishes, for coro_stack_usage().
+	 */
+	CORO_STACK_PAINT,
+	/**
+	 * Same as the painting, and in addition coro_new() gives a
+	 * coroutine a stack sized by the max usage ever seen for the
+	 * same function, plus a margin - the same as the usage but
+	 * at least 64KB. Until the first run of the function ends,
+	 * the stacks have the default size. A pooled coroutine with a
+	 * stack at least twice larger than needed is reused with the
+	 * stack shrunk in place - the bottom of it is unmapped, and
+	 * the guard page is moved up. The stacks of coro_new_many()
+	 * are shrunk the same way, leaving holes in the mapping of
+	 * their slab. The memory is not grown back, a shrunk stack
+	 * stays small in the pool.
+	 */
+	CORO_STACK_ADAPTIVE,
+};
+
+/**
+ * Set how the stacks are sized and measured. Applies to the
+ * coroutines created and finished after the call.
+ */
+void
+coro_sched_set_stack_mode(enum coro_stack_mode mode);
+
+/**
+ * Get how many bytes of the coroutine stack have been used, the
+ * high-water mark. For a finished coroutine it is known only when
+ * the stack mode isn't fixed. 0 for a coroutine on a shared stack.
+ * The stacks are zero-painted, so the zeros pushed at the very
+ * bottom of the used area might be not counted.
+ */
+size_t
+coro_stack_usage(const struct coro *coro);
+
+enum coro_priority {
+	/** Latency critical coroutines, like request handlers. */
+	CORO_PRIORITY_HIGH,
+	/** Default for the new coroutines. */
+	CORO_PRIORITY_NORMAL,
+	/** Background work. */
+	CORO_PRIORITY_LOW,
+	CORO_PRIORITY_COUNT,
+};
+
+/**
+ * Set the priority of a coroutine. The ready coroutines of each
+ * priority have their own queue and the higher priorities run
+ * first. When all the priorities are busy, the lower ones get less
+ * turns, but never starve: a high priority coroutine runs 4 times
+ * and a normal one 2 times per each turn of a low priority one. A
+ * coroutine already scheduled gets the new priority next time.
+ * The priority is reset to normal when the coroutine object is
+ * reused after join.
+ */
+void
+coro_set_priority(struct coro *coro, enum coro_priority priority);
+
+/**
+ * A safe point for the preemption. Long computations should call
+ * it from time to time, so as not to starve the other coroutines.
+ * It is cheap when the time slice is not over.
+ */
+void
+coro_check_preempt(void);
+
+/**
+ * Same as coro_suspend(), but the coroutine is woken up
+ * automatically when the timeout in seconds expires. The timeouts
+ * have a millisecond resolution and never fire earlier than
+ * requested.
+ * @retval true Woken up with coro_wakeup().
+ * @retval false Timed out.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/**
+ * Pause the current coroutine for the given number of seconds.
+ * The other coroutines keep working meanwhile. When nothing else
+ * is runnable, the scheduler sleeps until the nearest timeout
+ * instead of spinning.
+ */
+void
+coro_sleep(double duration);
+
+enum coro_fd_event {
+	CORO_FD_READ = 1,
+	CORO_FD_WRITE = 2,
+};
+
+/**
+ * Pause the current coroutine until the descriptor is ready for
+ * any of the given events - a mask of enum coro_fd_event. The
+ * other coroutines keep working meanwhile. When nothing else is
+ * runnable, the scheduler blocks in epoll until the descriptors
+ * are ready or a timeout expires. Only one coroutine at a time can
+ * wait on the same descriptor. The explicit wakeups are ignored.
+ *
+ * An error or hangup on the descriptor is reported as readiness
+ * for all the given events, so the following IO call fails with a
+ * proper error.
+ *
+ * A waited descriptor must not be closed by close() - the kernel
+ * silently drops it from epoll, and the waiter is never woken up.
+ * Use coro_close() instead.
+ * @retval >0 The events the descriptor is ready for.
+ * @retval -1 Error, errno is set. For example, the descriptor is
+ *         not valid or is already waited on.
+ */
+int
+coro_wait_fd(int fd, int events);
+
+/**
+ * Close the descriptor like close(), and wake up the coroutine
+ * waiting on it in coro_wait_fd(), which gets the descriptor as
+ * ready for all the events. In the multi-threaded mode only a
+ * waiter of the calling thread is found, so the descriptor has to
+ * be closed by a coroutine of the same thread.
+ */
+int
+coro_close(int fd);
+
+/**
+ * Asynchronous IO. The calls work like their system namesakes,
+ * but only pause the current coroutine - the other ones keep
+ * working while the kernel does the IO. On Linux the requests go
+ * to io_uring of the scheduler. They are submitted together once
+ * per scheduler iteration, and all the ready completions are
+ * taken at once. Where io_uring is not available, the requests are
+ * done by a few helper threads.
+ *
+ * The descriptors can be blocking or not, the calls wait for the
+ * result anyway. The memory given to a call must not be on the
+ * stack of a coroutine created by coro_new_shared() - the kernel
+ * can access it while another coroutine runs on that stack.
+ * @retval >=0 Same as of the system call.
+ * @retval -1 Error, errno is set.
+ */
+
+/** Read from the offset, or from the file position if it is -1. */
+ssize_t
+coro_read(int fd, void *buf, size_t size, off_t offset);
+
+/** Write at the offset, or at the file position if it is -1. */
+ssize_t
+coro_write(int fd, const void *buf, size_t size, off_t offset);
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_size);
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_size);
+
+int
+coro_fsync(int fd);
+
+/**
+ * Pause the current coroutine until coro_wakeup_remote() is called
+ * for it. If that happened already since the previous call, return
+ * right away, so the wakeup can't be lost. While there are such
+ * waiters, the scheduler doesn't stop and when nothing else is
+ * runnable, blocks until a remote wakeup comes.
+ */
+void
+coro_suspend_remote(void);
+
+/**
+ * Wake up the coroutine from any thread, including the ones not
+ * running coroutines. For example, from a thread pool task done
+ * for the coroutine. The wakeup is queued to the scheduler and is
+ * delivered on its next iteration the same way as coro_wakeup().
+ * The coroutine must not be joined until the wakeup is delivered.
+ */
+void
+coro_wakeup_remote(struct coro *coro);
+
+/**
+ * Same as coro_new(), but the coroutine doesn't have its own
+ * stack. It runs on one of a few stacks shared by all such
+ * coroutines. When another coroutine needs the stack, the used
+ * part of it is copied out into a heap buffer, and back in before
+ * the coroutine continues. A parked coroutine then takes only as
+ * much memory as its stack depth, which allows to keep millions
+ * of idle coroutines. The price is the copying on the switches.
+ *
+ * Addresses of the variables on such a coroutine's stack must not
+ * be used by the other coroutines - while the coroutine is not
+ * running, the memory can belong to another one. The shared
+ * stacks can't be used in the multi-threaded mode.
+ */
+struct coro *
+coro_new_shared(coro_f func, void *func_arg);
+
+/** Function of a generator. */
+typedef void (*coro_gen_f)(void *arg);
+
+struct coro_gen;
+
+/**
+ * Create a generator - a coroutine producing a stream of values
+ * for another coroutine, its consumer. The generator is not
+ * scheduled. It runs only when the consumer asks for the next
+ * value, and until it gives one with coro_gen_yield() or returns.
+ * The two switch to each other directly, with no queues and no
+ * scheduler in between, so a value costs just two context
+ * switches. When the generator is blocked on anything else, like
+ * IO or a mutex, the consumer waits too.
+ */
+struct coro_gen *
+coro_generator_new(coro_gen_f func, void *func_arg);
+
+/**
+ * Run the generator until it gives the next value. Can only be
+ * called by a coroutine, and by one at a time for a generator.
+ * @retval true The value is returned in @a value.
+ * @retval false The generator function has returned.
+ */
+bool
+coro_gen_next(struct coro_gen *gen, void **value);
+
+/**
+ * Give the value to the consumer of the current generator, and
+ * pause until the next value is asked for.
+ */
+void
+coro_gen_yield(void *value);
+
+/**
+ * Delete the generator. Its function must have returned by now,
+ * which is when coro_gen_next() returns false.
+ */
+void
+coro_generator_delete(struct coro_gen *gen);
+
+/** Counters of the scheduler. */
+struct coro_sched_stats {
+	/** Switches between the coroutines, including the scheduler. */
+	uint64_t switch_count;
+	/** Calls of coro_yield(). */
+	uint64_t yield_count;
+	/** Suspensions of any kind - explicit, in join, sleep, IO. */
+	uint64_t suspend_count;
+	/** Suspended coroutines woken up, including by timeouts. */
+	uint64_t wakeup_count;
+	/** Coroutines yielded because their time slice was over. */
+	uint64_t preempt_count;
+	/** Max number of the coroutines ready to run at once. */
+	size_t next_max;
+};
+
+/**
+ * Get the scheduler counters. They are cheap and always on. In the
+ * multi-threaded mode each thread has its own counters, and they
+ * are added to the main thread's ones when coro_sched_run_mt()
+ * returns.
+ */
+void
+coro_sched_stats(struct coro_sched_stats *stats);
+
+/** Counters of a coroutine. */
+struct coro_stats {
+	/** Number of times the coroutine got the CPU. */
+	uint64_t switch_count;
+	/** Time spent running, in nanoseconds. */
+	uint64_t run_time_ns;
+	/** Number of times the coroutine was preempted. */
+	uint64_t preempt_count;
+	/** Usable size of the stack, 0 for a shared stack. */
+	size_t stack_size;
+};
+
+/**
+ * Get the counters of a coroutine. They are reset when the
+ * coroutine object is reused for a new one after join. The run
+ * time is measured with the CPU timestamp counter where possible.
+ * It is always 0 when libcoro is built with LIBCORO_NO_RUN_TIME.
+ */
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats);
+
+/**
+ * Start recording the scheduling events - spawn, resume, suspend,
+ * yield, wakeup, finish, join - with their timestamps. Each thread
+ * keeps the last @a capacity events in its own ring buffer, so the
+ * recording doesn't need any locks. If the path is not NULL, the
+ * trace is dumped there by coro_sched_destroy(). Can only be
+ * called by the main thread, after coro_sched_init().
+ */
+void
+coro_trace_start(size_t capacity, const char *path);
+
+/** Stop recording the events. The recorded ones are kept. */
+void
+coro_trace_stop(void);
+
+/**
+ * Write the recorded events into the file in Chrome Trace Event
+ * JSON format. It can be opened in chrome://tracing or Perfetto UI.
+ * Each resume is shown as a slice lasting until the next one on the
+ * same thread.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_trace_dump(const char *path);
@@ -0,0 +1,713 @@
+#include "corobus.h"
+#include "libcoro.h"
+#include "libcoro_sync.h"
+#include "rlist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmarks of the coroutine engine and the bus. They are not a
+ * part of the tests and are built separately with 'make bench'.
+ *
+ * Each benchmark is run several times, and the min, median, and max
+ * time per operation are reported, so as the noise could be told
+ * from a real change.
+ */
+
+/** Number of runs of each benchmark. */
+#define BENCH_RUN_COUNT 7
+
+typedef struct coro *(*bench_new_f)(coro_f func, void *func_arg);
+
+/** One run of a benchmark. Returns nanoseconds per operation. */
+typedef double (*bench_run_f)(void *arg);
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+/** Run the benchmark several times and print the statistics. */
+static void
+bench_report(const char *name, bench_run_f run, void *arg)
+{
+	double times[BENCH_RUN_COUNT];
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times[i] = run(arg);
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp);
+	printf("%s\n", name);
+	printf("    min: %10.1f ns\n", times[0]);
+	printf("    med: %10.1f ns\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %10.1f ns\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+/** Resident memory of the process in bytes. */
+static size_t
+bench_rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	size_t total = 0, resident = 0;
+	if (fscanf(f, "%zu %zu", &total, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_park_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	return NULL;
+}
+
+struct bench_park_ctx {
+	bench_new_f new_f;
+	int coro_count;
+	size_t rss_delta;
+};
+
+static void *
+bench_park_main_f(void *arg)
+{
+	struct bench_park_ctx *ctx = arg;
+	struct coro **coros = malloc(sizeof(coros[0]) * ctx->coro_count);
+	size_t rss = bench_rss();
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coros[i] = ctx->new_f(bench_park_f, NULL);
+	/* Let all of them start and park. */
+	coro_yield();
+	coro_yield();
+	ctx->rss_delta = bench_rss() - rss;
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coro_wakeup(coros[i]);
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	return NULL;
+}
+
+/** Memory, not time - it is measured once. */
+static void
+bench_park(const char *name, bench_new_f new_f, int coro_count)
+{
+	struct bench_park_ctx ctx;
+	ctx.new_f = new_f;
+	ctx.coro_count = coro_count;
+	ctx.rss_delta = 0;
+	struct coro *c = coro_new(bench_park_main_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	printf("%s, parked %d coros\n", name, coro_count);
+	printf("    %.1f bytes per coro\n", (double)ctx.rss_delta / coro_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_noop_f(void *arg)
+{
+	return arg;
+}
+
+enum bench_spawn_mode {
+	/** coro_new() with an empty pool. */
+	BENCH_SPAWN_COLD,
+	/** coro_new_many() with an empty pool. */
+	BENCH_SPAWN_BATCH,
+	/** coro_new() reusing the pooled coroutines. */
+	BENCH_SPAWN_POOL,
+};
+
+struct bench_spawn_ctx {
+	enum bench_spawn_mode mode;
+	int coro_count;
+};
+
+static void
+bench_join_all(struct coro **coros, int count)
+{
+	coro_sched_run();
+	for (int i = 0; i < count; ++i)
+		coro_join(coros[i]);
+}
+
+/**
+ * Spawn a burst of coroutines, only the spawn is measured. The
+ * scheduler is recreated in the end, so as the next run starts
+ * from an empty pool too.
+ */
+static double
+bench_spawn_run(void *arg)
+{
+	struct bench_spawn_ctx *ctx = arg;
+	int count = ctx->coro_count;
+	struct coro **coros = malloc(sizeof(coros[0]) * count);
+	if (ctx->mode == BENCH_SPAWN_POOL) {
+		for (int i = 0; i < count; ++i)
+			coros[i] = coro_new(bench_noop_f, NULL);
+		bench_join_all(coros, count);
+	}
+	double start = bench_now();
+	if (ctx->mode == BENCH_SPAWN_BATCH) {
+		coro_new_many(count, bench_noop_f, NULL, coros);
+	} else {
+		for (int i = 0; i < count; ++i)
+			coros[i] = coro_new(bench_noop_f, NULL);
+	}
+	double duration = bench_now() - start;
+	bench_join_all(coros, count);
+	free(coros);
+	coro_sched_destroy();
+	coro_sched_init();
+	return duration * 1000000000 / count;
+}
+
+struct bench_spawn_join_ctx {
+	int iter_count;
+	double duration;
+};
+
+static void *
+bench_spawn_join_f(void *arg)
+{
+	struct bench_spawn_join_ctx *ctx = arg;
+	double start = bench_now();
+	for (int i = 0; i < ctx->iter_count; ++i)
+		coro_join(coro_new(bench_noop_f, NULL));
+	ctx->duration = bench_now() - start;
+	return NULL;
+}
+
+/** Full life of an empty coroutine, from the spawn to the join. */
+static double
+bench_spawn_join_run(void *arg)
+{
+	struct bench_spawn_join_ctx *ctx = arg;
+	struct coro *c = coro_new(bench_spawn_join_f, ctx);
+	coro_sched_run();
+	coro_join(c);
+	return ctx->duration * 1000000000 / ctx->iter_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+struct bench_switch_ctx {
+	bench_new_f new_f;
+	int coro_count;
+	int yield_count;
+};
+
+/** The coroutines yield to each other in a round. */
+static double
+bench_switch_run(void *arg)
+{
+	struct bench_switch_ctx *ctx = arg;
+	struct coro **coros = malloc(sizeof(coros[0]) * ctx->coro_count);
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coros[i] = ctx->new_f(bench_yield_f, &ctx->yield_count);
+	double start = bench_now();
+	coro_sched_run();
+	double duration = bench_now() - start;
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	return duration * 1000000000 /
+		((double)ctx->coro_count * ctx->yield_count);
+}
+
+struct bench_handoff_ctx {
+	struct coro *coros[2];
+	int handoff_count;
+	int iter_count;
+};
+
+struct bench_handoff_arg {
+	struct bench_handoff_ctx *ctx;
+	int id;
+};
+
+static void *
+bench_handoff_f(void *arg)
+{
+	struct bench_handoff_arg *a = arg;
+	struct bench_handoff_ctx *ctx = a->ctx;
+	struct coro *peer = ctx->coros[1 - a->id];
+	while (ctx->handoff_count < ctx->iter_count) {
+		++ctx->handoff_count;
+		coro_wakeup(peer);
+		coro_suspend();
+	}
+	coro_wakeup(peer);
+	return NULL;
+}
+
+/** Two coroutines wake each other up and suspend in turn. */
+static double
+bench_handoff_run(void *arg)
+{
+	struct bench_handoff_ctx *ctx = arg;
+	struct bench_handoff_arg args[2];
+	ctx->handoff_count = 0;
+	for (int i = 0; i < 2; ++i) {
+		args[i].ctx = ctx;
+		args[i].id = i;
+		ctx->coros[i] = coro_new(bench_handoff_f, &args[i]);
+	}
+	double start = bench_now();
+	coro_sched_run();
+	double duration = bench_now() - start;
+	for (int i = 0; i < 2; ++i)
+		coro_join(ctx->coros[i]);
+	return duration * 1000000000 / ctx->handoff_count;
+}
+
+struct bench_latency_ctx {
+	void (*wakeup_f)(struct coro *coro);
+	int busy_count;
+	int iter_count;
+	bool is_stopped;
+	struct coro *waiter;
+	double wakeup_time;
+	double latency;
+};
+
+static void *
+bench_latency_busy_f(void *arg)
+{
+	struct bench_latency_ctx *ctx = arg;
+	while (!ctx->is_stopped)
+		coro_yield();
+	return NULL;
+}
+
+static void *
+bench_latency_waiter_f(void *arg)
+{
+	struct bench_latency_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		coro_suspend();
+		ctx->latency += bench_now() - ctx->wakeup_time;
+	}
+	return NULL;
+}
+
+static void *
+bench_latency_waker_f(void *arg)
+{
+	struct bench_latency_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		ctx->wakeup_time = bench_now();
+		ctx->wakeup_f(ctx->waiter);
+		coro_yield();
+	}
+	ctx->is_stopped = true;
+	return NULL;
+}
+
+/**
+ * Time from a wakeup till the woken up coroutine runs, while many
+ * other coroutines are runnable.
+ */
+static double
+bench_latency_run(void *arg)
+{
+	struct bench_latency_ctx *ctx = arg;
+	ctx->is_stopped = false;
+	ctx->latency = 0;
+	struct coro **coros = malloc(sizeof(coros[0]) * ctx->busy_count);
+	for (int i = 0; i < ctx->busy_count; ++i)
+		coros[i] = coro_new(bench_latency_busy_f, ctx);
+	ctx->waiter = coro_new(bench_latency_waiter_f, ctx);
+	struct coro *waker = coro_new(bench_latency_waker_f, ctx);
+	coro_sched_run();
+	coro_join(waker);
+	coro_join(ctx->waiter);
+	for (int i = 0; i < ctx->busy_count; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	return ctx->latency * 1000000000 / ctx->iter_count;
+}
+
+static void
+bench_gen_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_gen_yield(NULL);
+}
+
+struct bench_gen_ctx {
+	int iter_count;
+	double duration;
+};
+
+static void *
+bench_gen_main_f(void *arg)
+{
+	struct bench_gen_ctx *ctx = arg;
+	struct coro_gen *gen = coro_generator_new(bench_gen_f,
+		&ctx->iter_count);
+	void *value;
+	double start = bench_now();
+	while (coro_gen_next(gen, &value))
+		;
+	ctx->duration = bench_now() - start;
+	coro_generator_delete(gen);
+	return NULL;
+}
+
+/** A generator streams values to its consumer. */
+static double
+bench_gen_run(void *arg)
+{
+	struct bench_gen_ctx *ctx = arg;
+	struct coro *c = coro_new(bench_gen_main_f, ctx);
+	coro_sched_run();
+	coro_join(c);
+	return ctx->duration * 1000000000 / ctx->iter_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Mutex on a hand-written wakeup queue, the way it is usually done
+ * with coro_suspend() and coro_wakeup(). A woken up coroutine has
+ * to compete for the mutex again.
+ */
+struct bench_wq_mutex {
+	bool is_locked;
+	struct rlist waiters;
+};
+
+struct bench_wq_entry {
+	struct rlist link;
+	struct coro *coro;
+};
+
+static void
+bench_wq_mutex_lock(struct bench_wq_mutex *mutex)
+{
+	while (mutex->is_locked) {
+		struct bench_wq_entry entry;
+		entry.coro = coro_this();
+		rlist_add_tail_entry(&mutex->waiters, &entry, link);
+		coro_suspend();
+		rlist_del_entry(&entry, link);
+	}
+	mutex->is_locked = true;
+}
+
+static void
+bench_wq_mutex_unlock(struct bench_wq_mutex *mutex)
+{
+	mutex->is_locked = false;
+	if (rlist_empty(&mutex->waiters))
+		return;
+	coro_wakeup(rlist_first_entry(&mutex->waiters, struct bench_wq_entry,
+		link)->coro);
+}
+
+struct bench_mutex_ctx {
+	coro_f func;
+	int coro_count;
+	struct coro_mutex mutex;
+	struct bench_wq_mutex wq_mutex;
+	int iter_count;
+	/** Last coroutine which has taken the mutex. */
+	struct coro *owner;
+	/** How many times the mutex went to another coroutine. */
+	long handoff_count;
+};
+
+static void
+bench_mutex_taken(struct bench_mutex_ctx *ctx)
+{
+	if (ctx->owner != coro_this())
+		++ctx->handoff_count;
+	ctx->owner = coro_this();
+}
+
+static void *
+bench_mutex_f(void *arg)
+{
+	struct bench_mutex_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		bench_mutex_taken(ctx);
+		coro_yield();
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	return NULL;
+}
+
+static void *
+bench_wq_mutex_f(void *arg)
+{
+	struct bench_mutex_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		bench_wq_mutex_lock(&ctx->wq_mutex);
+		bench_mutex_taken(ctx);
+		coro_yield();
+		bench_wq_mutex_unlock(&ctx->wq_mutex);
+	}
+	return NULL;
+}
+
+/**
+ * All the coroutines contend for one mutex, and each holds it for
+ * a scheduler iteration. The time is per lock/unlock cycle. How
+ * often the mutex actually went to another coroutine is counted
+ * separately - the wakeup queue lets the owner take the mutex again
+ * before the woken up waiter gets to run, and it is fairness, not
+ * speed.
+ */
+static double
+bench_mutex_run(void *arg)
+{
+	struct bench_mutex_ctx *ctx = arg;
+	coro_mutex_create(&ctx->mutex);
+	ctx->wq_mutex.is_locked = false;
+	rlist_create(&ctx->wq_mutex.waiters);
+	ctx->owner = NULL;
+	ctx->handoff_count = 0;
+	struct coro **coros = malloc(sizeof(coros[0]) * ctx->coro_count);
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coros[i] = coro_new(ctx->func, ctx);
+	double start = bench_now();
+	coro_sched_run();
+	double duration = bench_now() - start;
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	return duration * 1000000000 / ((double)ctx->coro_count *
+		ctx->iter_count);
+}
+
+static void
+bench_mutex_report(const char *name, struct bench_mutex_ctx *ctx)
+{
+	bench_report(name, bench_mutex_run, ctx);
+	/* The scheduling is deterministic, the last run is enough. */
+	printf("    %ld handoffs of %ld cycles\n", ctx->handoff_count,
+		(long)ctx->coro_count * ctx->iter_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_bus_ctx {
+	/** coro_bus_new() or coro_bus_new_mt(). */
+	struct coro_bus *(*new_f)(void);
+	/** Number of the messages kept in the channel at once. */
+	unsigned depth;
+	/** Number of the messages sent and received per call. */
+	unsigned batch;
+	int round_count;
+};
+
+/**
+ * Fill a channel up to the depth and drain it, a number of times.
+ * The cost of a message must not depend on the depth.
+ */
+static double
+bench_bus_run(void *arg)
+{
+	struct bench_bus_ctx *ctx = arg;
+	struct coro_bus *bus = ctx->new_f();
+	int channel = coro_bus_channel_open(bus, 100000);
+	unsigned *data = calloc(ctx->batch, sizeof(data[0]));
+	/* Let the channel allocate its memory before the measurement. */
+	for (unsigned i = 0; i < ctx->depth; ++i)
+		coro_bus_try_send(bus, channel, i);
+	for (unsigned i = 0; i < ctx->depth; ++i)
+		coro_bus_try_recv(bus, channel, &data[0]);
+	double start = bench_now();
+	for (int r = 0; r < ctx->round_count; ++r) {
+		for (unsigned i = 0; i < ctx->depth; i += ctx->batch)
+			coro_bus_try_send_v(bus, channel, data, ctx->batch);
+		for (unsigned i = 0; i < ctx->depth; i += ctx->batch)
+			coro_bus_try_recv_v(bus, channel, data, ctx->batch);
+	}
+	double duration = bench_now() - start;
+	free(data);
+	coro_bus_channel_close(bus, channel);
+	coro_bus_delete(bus);
+	return duration * 1000000000 / ((double)ctx->depth * ctx->round_count);
+}
+
+struct bench_bus_msg_ctx {
+	/** Payload size of the byte messages. */
+	size_t size;
+	unsigned depth;
+	int round_count;
+};
+
+/** Same as the above, but with the byte messages. */
+static double
+bench_bus_msg_run(void *arg)
+{
+	struct bench_bus_msg_ctx *ctx = arg;
+	struct coro_bus *bus = coro_bus_new();
+	int channel = coro_bus_channel_open_msg(bus, 100000, SIZE_MAX);
+	char *data = calloc(1, ctx->size);
+	double start = bench_now();
+	for (int r = 0; r < ctx->round_count; ++r) {
+		for (unsigned i = 0; i < ctx->depth; ++i)
+			coro_bus_try_send_bytes(bus, channel, data, ctx->size);
+		for (unsigned i = 0; i < ctx->depth; ++i)
+			coro_bus_try_recv_bytes(bus, channel, data, ctx->size);
+	}
+	double duration = bench_now() - start;
+	free(data);
+	coro_bus_channel_close(bus, channel);
+	coro_bus_delete(bus);
+	return duration * 1000000000 / ((double)ctx->depth * ctx->round_count);
+}
+
+struct bench_bus_open_ctx {
+	/** Number of the channels kept open all the time. */
+	int open_count;
+	int iter_count;
+};
+
+/** Open and close a channel, while many others are open. */
+static double
+bench_bus_open_run(void *arg)
+{
+	struct bench_bus_open_ctx *ctx = arg;
+	struct coro_bus *bus = coro_bus_new();
+	int *channels = malloc(sizeof(channels[0]) * ctx->open_count);
+	for (int i = 0; i < ctx->open_count; ++i)
+		channels[i] = coro_bus_channel_open(bus, 1);
+	/* Holes all over the table. */
+	for (int i = 0; i < ctx->open_count; i += 2)
+		coro_bus_channel_close(bus, channels[i]);
+	double start = bench_now();
+	for (int i = 0; i < ctx->iter_count; ++i)
+		coro_bus_channel_close(bus, coro_bus_channel_open(bus, 1));
+	double duration = bench_now() - start;
+	for (int i = 1; i < ctx->open_count; i += 2)
+		coro_bus_channel_close(bus, channels[i]);
+	free(channels);
+	coro_bus_delete(bus);
+	return duration * 1000000000 / ctx->iter_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(void)
+{
+	coro_sched_init();
+
+	struct bench_spawn_join_ctx spawn_join = {.iter_count = 200000};
+	bench_report("spawn + join, empty coro", bench_spawn_join_run,
+		&spawn_join);
+	struct bench_spawn_ctx spawn = {.coro_count = 10000};
+	spawn.mode = BENCH_SPAWN_COLD;
+	bench_report("spawn, empty pool, coro_new", bench_spawn_run, &spawn);
+	spawn.mode = BENCH_SPAWN_BATCH;
+	bench_report("spawn, empty pool, coro_new_many", bench_spawn_run,
+		&spawn);
+	spawn.mode = BENCH_SPAWN_POOL;
+	bench_report("spawn, pool reuse, coro_new", bench_spawn_run, &spawn);
+
+	struct bench_switch_ctx sw = {.yield_count = 200000};
+	sw.coro_count = 2;
+	sw.new_f = coro_new;
+	bench_report("yield ping-pong, 2 coros", bench_switch_run, &sw);
+	sw.new_f = coro_new_shared;
+	bench_report("yield ping-pong, 2 shared stack coros",
+		bench_switch_run, &sw);
+	sw.coro_count = 8;
+	sw.new_f = coro_new;
+	bench_report("yield round, 8 coros", bench_switch_run, &sw);
+	/* More coros than the shared stacks - each switch copies. */
+	sw.new_f = coro_new_shared;
+	bench_report("yield round, 8 shared stack coros", bench_switch_run,
+		&sw);
+
+	struct bench_handoff_ctx handoff = {.iter_count = 200000};
+	bench_report("suspend/wakeup handoff", bench_handoff_run, &handoff);
+
+	struct bench_latency_ctx latency = {.busy_count = 1000,
+		.iter_count = 2000};
+	latency.wakeup_f = coro_wakeup;
+	bench_report("wakeup latency, 1000 runnable coros, coro_wakeup",
+		bench_latency_run, &latency);
+	latency.wakeup_f = coro_wakeup_and_switch;
+	bench_report("wakeup latency, 1000 runnable coros, "
+		"coro_wakeup_and_switch", bench_latency_run, &latency);
+
+	struct bench_gen_ctx gen = {.iter_count = 200000};
+	bench_report("generator, per value", bench_gen_run, &gen);
+
+	struct bench_mutex_ctx mutex = {.coro_count = 8, .iter_count = 20000};
+	mutex.func = bench_mutex_f;
+	bench_mutex_report("coro_mutex lock + unlock, 8 coros", &mutex);
+	mutex.func = bench_wq_mutex_f;
+	bench_mutex_report("wakeup queue mutex lock + unlock, 8 coros",
+		&mutex);
+
+	struct bench_bus_ctx bus = {.new_f = coro_bus_new, .batch = 1};
+	bus.depth = 100;
+	bus.round_count = 10000;
+	bench_report("corobus send + recv, 100 queued", bench_bus_run, &bus);
+	bus.depth = 100000;
+	bus.round_count = 10;
+	bench_report("corobus send + recv, 100000 queued", bench_bus_run,
+		&bus);
+	bus.batch = 64;
+	bench_report("corobus send_v + recv_v by 64, 100000 queued",
+		bench_bus_run, &bus);
+	bus.new_f = coro_bus_new_mt;
+	bus.batch = 1;
+	bus.depth = 100;
+	bus.round_count = 10000;
+	bench_report("thread-safe corobus send + recv, 100 queued",
+		bench_bus_run, &bus);
+	struct bench_bus_msg_ctx bus_msg = {.depth = 100, .round_count = 10000};
+	bus_msg.size = 16;
+	bench_report("corobus send_bytes + recv_bytes, 16 bytes",
+		bench_bus_msg_run, &bus_msg);
+	bus_msg.size = 256;
+	bench_report("corobus send_bytes + recv_bytes, 256 bytes",
+		bench_bus_msg_run, &bus_msg);
+	struct bench_bus_open_ctx bus_open = {.open_count = 20000,
+		.iter_count = 200000};
+	bench_report("corobus channel open + close, 10000 open",
+		bench_bus_open_run, &bus_open);
+
+	/* Dedicated stacks take 2 mappings each, mind vm.max_map_count. */
+	bench_park("dedicated stacks", coro_new, 20000);
+	bench_park("shared stacks", coro_new_shared, 200000);
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "rlist.h"
+
+#include <stdbool.h>
+
+/**
+ * Synchronization primitives for the coroutines. A coroutine
+ * waiting for a primitive is suspended in its queue of waiters.
+ * When the resource is released, it is handed over directly to the
+ * first waiter, the others keep sleeping. The primitives can be
+ * embedded into any objects, don't need to be destroyed, and never
+ * allocate memory. They work in the multi-threaded mode too.
+ *
+ * A waiter is queued by its coroutine object, not by its stack, so
+ * the coroutines of coro_new_shared() can wait too. But a primitive
+ * itself must not be on such a stack, if other coroutines use it.
+ */
+
+struct coro_mutex {
+	/** Spinlock for the multi-threaded mode. */
+	bool lock;
+	/** True while some coroutine owns the mutex. */
+	bool is_locked;
+	/** Coroutines waiting for the mutex. */
+	struct rlist waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *mutex);
+
+/** Lock the mutex, waiting until its owner unlocks it. */
+void
+coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Lock the mutex if it is free. Return true on success. */
+bool
+coro_mutex_trylock(struct coro_mutex *mutex);
+
+/**
+ * Unlock the mutex. If there are waiters, the first one becomes
+ * the owner right away, so nobody can steal the mutex from it.
+ */
+void
+coro_mutex_unlock(struct coro_mutex *mutex);
+
+struct coro_cond {
+	/** Spinlock for the multi-threaded mode. */
+	bool lock;
+	/** Coroutines waiting for a signal. */
+	struct rlist waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex and wait for a signal. The mutex is locked
+ * again before the return. There are no spurious wakeups.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+/** Wake up the first waiter, if there are any. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+struct coro_sem {
+	/** Spinlock for the multi-threaded mode. */
+	bool lock;
+	/** Number of the available units. */
+	unsigned count;
+	/** Coroutines waiting for a unit. */
+	struct rlist waiters;
+};
+
+void
+coro_sem_create(struct coro_sem *sem, unsigned count);
+
+/** Take a unit, waiting until one is available. */
+void
+coro_sem_wait(struct coro_sem *sem);
+
+/** Take a unit if one is available. Return true on success. */
+bool
+coro_sem_trywait(struct coro_sem *sem);
+
+/**
+ * Return a unit. If there are waiters, the unit is given to the
+ * first one right away.
+ */
+void
+coro_sem_post(struct coro_sem *sem);
+
+struct coro_wait_group {
+	/** Spinlock for the multi-threaded mode. */
+	bool lock;
+	/** Number of the not done jobs. */
+	unsigned count;
+	/** Coroutines waiting for all the jobs to be done. */
+	struct rlist waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *group);
+
+/** Add jobs to wait for. */
+void
+coro_wait_group_add(struct coro_wait_group *group, unsigned count);
+
+/** Finish one job. The last one wakes up all the waiters. */
+void
+coro_wait_group_done(struct coro_wait_group *group);
+
+/** Wait until all the added jobs are done. */
+void
+coro_wait_group_wait(struct coro_wait_group *group);
@@ -1,7 +1,19 @@
 #include "libcoro.h"
+#include "libcoro_sync.h"
 
 #include "unit.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -121,6 +133,59 @@ test_wakup_self(void)
 	unit_test_finish();
 }
 
+struct test_handoff_ctx {
+	int turns;
+	bool is_stopped;
+};
+
+static void *
+test_handoff_busy_f(void *arg)
+{
+	struct test_handoff_ctx *ctx = arg;
+	while (!ctx->is_stopped) {
+		++ctx->turns;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_handoff_waiter_f(void *arg)
+{
+	struct test_handoff_ctx *ctx = arg;
+	coro_suspend();
+	return (void *)(intptr_t)ctx->turns;
+}
+
+static void
+test_wakeup_and_switch(void)
+{
+	unit_test_start();
+
+	struct test_handoff_ctx ctx;
+	ctx.turns = 0;
+	ctx.is_stopped = false;
+	struct coro *busy[10];
+	for (int i = 0; i < 10; ++i)
+		busy[i] = coro_new(test_handoff_busy_f, &ctx);
+	struct coro *waiter = coro_new(test_handoff_waiter_f, &ctx);
+	coro_yield();
+	int turns = ctx.turns;
+	coro_wakeup_and_switch(waiter);
+	unit_check(coro_join(waiter) == (void *)(intptr_t)turns,
+		"woken up coro runs ahead of the others");
+
+	turns = ctx.turns;
+	coro_wakeup_and_switch(busy[0]);
+	unit_check(ctx.turns == turns, "nop for a not suspended coro");
+
+	ctx.is_stopped = true;
+	for (int i = 0; i < 10; ++i)
+		coro_join(busy[i]);
+
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +227,1216 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_double_f(void *arg)
+{
+	double *value = arg;
+	double sum = 0;
+	for (int i = 0; i < 10; ++i) {
+		sum += *value;
+		coro_yield();
+	}
+	return (void *)(sum == *value * 10 ? arg : NULL);
+}
+
+static void
+test_many_coros(void)
+{
+	unit_test_start();
+
+	const int coro_count = 1000;
+	struct coro *coros[coro_count];
+	double values[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		values[i] = i * 0.5;
+		coros[i] = coro_new(test_double_f, &values[i]);
+	}
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &values[i];
+	unit_check(ok, "all the coros kept their registers and stacks");
+
+	unit_test_finish();
+}
+
+static void *
+test_return_arg_f(void *arg)
+{
+	coro_yield();
+	return arg;
+}
+
+static void
+test_new_many(void)
+{
+	unit_test_start();
+
+	/* More than the pool has, so a slab is allocated. */
+	const int coro_count = 3000;
+	struct coro **coros = malloc(sizeof(coros[0]) * coro_count);
+	double *values = malloc(sizeof(values[0]) * coro_count);
+	void **args = malloc(sizeof(args[0]) * coro_count);
+	for (int i = 0; i < coro_count; ++i) {
+		values[i] = i * 0.5;
+		args[i] = &values[i];
+	}
+	coro_new_many(coro_count, test_double_f, args, coros);
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &values[i];
+	unit_check(ok, "all the coros got their args");
+
+	coro_sched_reserve(coro_count * 2);
+	coro_new_many(coro_count * 2 / 3, test_return_arg_f, NULL, coros);
+	ok = true;
+	for (int i = 0; i < coro_count * 2 / 3; ++i)
+		ok = ok && coro_join(coros[i]) == NULL;
+	unit_check(ok, "null args");
+
+	free(args);
+	free(values);
+	free(coros);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_use_stack_f(void *arg)
+{
+	size_t size = *(size_t *)arg;
+	volatile char buf[size];
+	for (size_t i = 0; i < size; i += 1024)
+		buf[i] = (char)i;
+	coro_yield();
+	for (size_t i = 0; i < size; i += 1024) {
+		if (buf[i] != (char)i)
+			return NULL;
+	}
+	return arg;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	size_t small_use = 32 * 1024;
+	struct coro *small = coro_new_ex(test_use_stack_f, &small_use,
+		64 * 1024);
+	unit_check(coro_join(small) == &small_use, "small stack is usable");
+
+	size_t big_use = 3 * 1024 * 1024;
+	struct coro *big = coro_new_ex(test_use_stack_f, &big_use,
+		4 * 1024 * 1024);
+	unit_check(big != small, "small pooled stack is not reused for a big one");
+	unit_check(coro_join(big) == &big_use, "big stack is usable");
+
+	struct coro *c = coro_new_ex(test_use_stack_f, &small_use, 0);
+	unit_check(c == big, "big pooled stack is reused");
+	unit_check(coro_join(c) == &small_use, "reused stack is usable");
+
+	/*
+	 * Run out of the memory mappings in a child process, so as
+	 * the other tests still have them.
+	 */
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		for (int i = 0; i < 1000000; ++i) {
+			if (coro_new(test_return_arg_f, NULL) == NULL)
+				_exit(errno == ENOMEM ? 0 : 1);
+		}
+		_exit(2);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	unit_check(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+		"out of stacks is ENOMEM");
+
+	unit_test_finish();
+}
+
+static void
+test_shared_stack(void)
+{
+	unit_test_start();
+
+	const int coro_count = 100;
+	struct coro *coros[coro_count];
+	double values[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		values[i] = i * 0.5;
+		coros[i] = coro_new_shared(test_double_f, &values[i]);
+	}
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &values[i];
+	unit_check(ok, "all the coros kept their stacks while shared");
+
+	/* More coros than the shared stacks, so some do share. */
+	size_t big_use = 256 * 1024;
+	for (int i = 0; i < 10; ++i)
+		coros[i] = coro_new_shared(test_use_stack_f, &big_use);
+	unit_check(coros[0] == coros[coro_count - 1],
+		"shared stack coro is reused");
+	ok = true;
+	for (int i = 0; i < 10; ++i)
+		ok = ok && coro_join(coros[i]) == &big_use;
+	unit_check(ok, "deep shared stacks are kept");
+
+	unit_test_finish();
+}
+
+struct test_priority_ctx {
+	int turns[CORO_PRIORITY_COUNT];
+	int turns_at_high_end[CORO_PRIORITY_COUNT];
+};
+
+struct test_priority_arg {
+	struct test_priority_ctx *ctx;
+	enum coro_priority priority;
+};
+
+static void *
+test_stack_usage_f(void *arg)
+{
+	size_t size = *(size_t *)arg;
+	volatile char buf[size];
+	for (size_t i = 0; i < size; ++i)
+		buf[i] = 1;
+	coro_yield();
+	return buf[0] == 1 ? arg : NULL;
+}
+
+static void
+test_stack_usage(void)
+{
+	unit_test_start();
+
+	coro_sched_set_stack_mode(CORO_STACK_PAINT);
+	size_t big_use = 200 * 1024;
+	struct coro *c = coro_new(test_stack_usage_f, &big_use);
+	coro_yield();
+	size_t usage = coro_stack_usage(c);
+	unit_check(usage >= big_use && usage < big_use + 16 * 1024,
+		"stack usage of a running coro");
+	/* Let it finish, but not be joined. */
+	coro_yield();
+	usage = coro_stack_usage(c);
+	unit_check(usage >= big_use && usage < big_use + 16 * 1024,
+		"stack usage of a finished coro");
+	coro_join(c);
+
+	size_t small_use = 1024;
+	struct coro *reused = coro_new(test_stack_usage_f, &small_use);
+	unit_assert(reused == c);
+	coro_yield();
+	unit_check(coro_stack_usage(c) < 16 * 1024, "reused stack is repainted");
+	coro_join(c);
+
+	coro_sched_set_stack_mode(CORO_STACK_ADAPTIVE);
+	c = coro_new(test_stack_usage_f, &big_use);
+	coro_join(c);
+	c = coro_new(test_stack_usage_f, &big_use);
+	struct coro_stats stats;
+	coro_stats(c, &stats);
+	unit_check(stats.stack_size >= big_use * 2 &&
+		stats.stack_size <= big_use * 3, "adaptive stack size");
+	unit_check(coro_join(c) == &big_use, "adaptive stack is usable");
+	coro_sched_set_stack_mode(CORO_STACK_FIXED);
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_KEY_COUNT = 10,
+};
+
+static coro_key_t test_keys[TEST_KEY_COUNT];
+static int test_key_destroyed;
+
+static void
+test_key_destructor(void *value)
+{
+	test_key_destroyed += *(int *)value;
+}
+
+static void *
+test_specific_f(void *arg)
+{
+	int *values = arg;
+	bool ok = true;
+	for (int i = 0; i < TEST_KEY_COUNT; ++i)
+		ok = ok && coro_getspecific(test_keys[i]) == NULL;
+	for (int i = 0; i < TEST_KEY_COUNT; ++i)
+		ok = ok && coro_setspecific(test_keys[i], &values[i]) == 0;
+	coro_yield();
+	for (int i = 0; i < TEST_KEY_COUNT; ++i)
+		ok = ok && coro_getspecific(test_keys[i]) == &values[i];
+	return ok ? arg : NULL;
+}
+
+static void
+test_specific(void)
+{
+	unit_test_start();
+
+	for (int i = 0; i < TEST_KEY_COUNT; ++i) {
+		unit_fail_if(coro_key_create(&test_keys[i],
+			i == 0 || i == TEST_KEY_COUNT - 1 ?
+			test_key_destructor : NULL) != 0);
+	}
+	unit_check(coro_setspecific(CORO_KEYS_MAX, NULL) == -1,
+		"not created key");
+
+	int values[2][TEST_KEY_COUNT];
+	for (int i = 0; i < TEST_KEY_COUNT; ++i) {
+		values[0][i] = i;
+		values[1][i] = i * 10;
+	}
+	test_key_destroyed = 0;
+	struct coro *a = coro_new(test_specific_f, values[0]);
+	struct coro *b = coro_new(test_specific_f, values[1]);
+	unit_check(coro_join(a) == values[0] && coro_join(b) == values[1],
+		"each coro has its own values");
+	unit_check(test_key_destroyed == 9 + 90, "destructors are called");
+
+	/* Reused coros must start with no values. */
+	a = coro_new(test_specific_f, values[0]);
+	b = coro_new(test_specific_f, values[1]);
+	unit_check(coro_join(a) == values[0] && coro_join(b) == values[1],
+		"values are cleared on reuse");
+
+	unit_test_finish();
+}
+
+static void
+test_gen_count_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i) {
+		/* Blocking in the middle must not break the stream. */
+		if (i == count / 2)
+			coro_yield();
+		coro_gen_yield((void *)(intptr_t)i);
+	}
+}
+
+static void
+test_gen_even_f(void *arg)
+{
+	struct coro_gen *src = arg;
+	void *value;
+	while (coro_gen_next(src, &value)) {
+		if ((intptr_t)value % 2 == 0)
+			coro_gen_yield(value);
+	}
+}
+
+static void
+test_generator(void)
+{
+	unit_test_start();
+
+	int count = 100;
+	struct coro_gen *gen = coro_generator_new(test_gen_count_f, &count);
+	void *value;
+	int next = 0;
+	bool ok = true;
+	while (coro_gen_next(gen, &value))
+		ok = ok && (intptr_t)value == next++;
+	unit_check(ok && next == count, "values in order");
+	unit_check(!coro_gen_next(gen, &value), "finished stays finished");
+	coro_generator_delete(gen);
+
+	struct coro_gen *src = coro_generator_new(test_gen_count_f, &count);
+	gen = coro_generator_new(test_gen_even_f, src);
+	next = 0;
+	ok = true;
+	while (coro_gen_next(gen, &value)) {
+		ok = ok && (intptr_t)value == next;
+		next += 2;
+	}
+	unit_check(ok && next == count, "generator of a generator");
+	coro_generator_delete(gen);
+	coro_generator_delete(src);
+
+	unit_test_finish();
+}
+
+static void *
+test_priority_f(void *arg)
+{
+	struct test_priority_arg *a = arg;
+	struct test_priority_ctx *ctx = a->ctx;
+	coro_set_priority(coro_this(), a->priority);
+	for (int i = 0; i < 40; ++i) {
+		++ctx->turns[a->priority];
+		coro_yield();
+	}
+	if (a->priority == CORO_PRIORITY_HIGH) {
+		memcpy(ctx->turns_at_high_end, ctx->turns,
+			sizeof(ctx->turns));
+	}
+	return NULL;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct test_priority_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	struct test_priority_arg args[CORO_PRIORITY_COUNT];
+	struct coro *coros[CORO_PRIORITY_COUNT];
+	for (int i = CORO_PRIORITY_COUNT - 1; i >= 0; --i) {
+		args[i].ctx = &ctx;
+		args[i].priority = i;
+		coros[i] = coro_new(test_priority_f, &args[i]);
+	}
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i)
+		coro_join(coros[i]);
+	int *turns = ctx.turns_at_high_end;
+	unit_check(turns[CORO_PRIORITY_NORMAL] >= 15 &&
+		turns[CORO_PRIORITY_NORMAL] <= 25, "normal runs half as often");
+	unit_check(turns[CORO_PRIORITY_LOW] >= 5 &&
+		turns[CORO_PRIORITY_LOW] <= 15, "low runs 4 times less often");
+	unit_check(ctx.turns[CORO_PRIORITY_LOW] == 40, "low doesn't starve");
+
+	unit_test_finish();
+}
+
+static void *
+test_stats_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_suspend();
+	/* Burn some CPU to have the run time visible. */
+	volatile double sum = 0;
+	for (int i = 0; i < 1000000; ++i)
+		sum += i;
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats before, after;
+	coro_sched_stats(&before);
+	struct coro *c = coro_new(test_stats_f, NULL);
+	for (int i = 0; i < 12; ++i)
+		coro_yield();
+	coro_wakeup(c);
+	coro_yield();
+	struct coro_stats stats;
+	coro_stats(c, &stats);
+	unit_check(stats.switch_count == 12, "coro switch count");
+	unit_check(stats.run_time_ns > 0, "coro run time");
+	coro_join(c);
+	coro_sched_stats(&after);
+	unit_check(after.yield_count - before.yield_count == 10 + 13,
+		"yield count");
+	unit_check(after.suspend_count - before.suspend_count == 1,
+		"suspend count");
+	unit_check(after.wakeup_count - before.wakeup_count == 1,
+		"wakeup count");
+	unit_check(after.switch_count > before.switch_count, "switch count");
+	unit_check(after.next_max >= 2, "max run queue length");
+
+	unit_test_finish();
+}
+
+static void
+test_trace(void)
+{
+	unit_test_start();
+
+	coro_trace_start(1024, NULL);
+	struct coro *c = coro_new(test_stats_f, NULL);
+	coro_yield();
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_wakeup(c);
+	coro_join(c);
+	coro_trace_stop();
+
+	char path[] = "/tmp/libcoro_trace_XXXXXX";
+	int fd = mkstemp(path);
+	unit_assert(fd >= 0);
+	close(fd);
+	unit_check(coro_trace_dump(path) == 0, "trace is dumped");
+	FILE *f = fopen(path, "r");
+	unit_assert(f != NULL);
+	static char buf[1024 * 1024];
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[size] = 0;
+	fclose(f);
+	unlink(path);
+	unit_check(strncmp(buf, "{\"traceEvents\":[", 16) == 0,
+		"trace format");
+	unit_check(strstr(buf, "\"name\":\"wakeup\"") != NULL &&
+		strstr(buf, "\"name\":\"spawn\"") != NULL &&
+		strstr(buf, "\"name\":\"join\"") != NULL, "trace has events");
+	unit_check(strstr(buf, "\"ph\":\"X\"") != NULL,
+		"trace has run slices");
+
+	unit_test_finish();
+}
+
+struct test_sync_ctx {
+	struct coro_mutex mutex;
+	struct coro_cond cond;
+	struct coro_sem sem;
+	struct coro_wait_group group;
+	int inside;
+	int max_inside;
+	int value;
+	int iter_count;
+};
+
+static void *
+test_mutex_f(void *arg)
+{
+	struct test_sync_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		if (++ctx->inside > ctx->max_inside)
+			ctx->max_inside = ctx->inside;
+		int value = ctx->value;
+		coro_yield();
+		ctx->value = value + 1;
+		--ctx->inside;
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	coro_wait_group_done(&ctx->group);
+	return NULL;
+}
+
+static void *
+test_sem_f(void *arg)
+{
+	struct test_sync_ctx *ctx = arg;
+	coro_sem_wait(&ctx->sem);
+	if (++ctx->inside > ctx->max_inside)
+		ctx->max_inside = ctx->inside;
+	coro_yield();
+	coro_yield();
+	--ctx->inside;
+	coro_sem_post(&ctx->sem);
+	coro_wait_group_done(&ctx->group);
+	return NULL;
+}
+
+static void *
+test_cond_f(void *arg)
+{
+	struct test_sync_ctx *ctx = arg;
+	coro_mutex_lock(&ctx->mutex);
+	while (ctx->value == 0)
+		coro_cond_wait(&ctx->cond, &ctx->mutex);
+	--ctx->value;
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void
+test_sync(void)
+{
+	unit_test_start();
+
+	const int coro_count = 10;
+	struct coro *coros[coro_count];
+	struct test_sync_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.iter_count = 10;
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	coro_sem_create(&ctx.sem, 3);
+	coro_wait_group_create(&ctx.group);
+
+	coro_wait_group_add(&ctx.group, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mutex_f, &ctx);
+	coro_wait_group_wait(&ctx.group);
+	unit_check(ctx.value == coro_count * ctx.iter_count &&
+		ctx.max_inside == 1, "mutex");
+	unit_check(coro_mutex_trylock(&ctx.mutex), "free mutex trylock");
+	unit_check(!coro_mutex_trylock(&ctx.mutex), "locked mutex trylock");
+	coro_mutex_unlock(&ctx.mutex);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+
+	/* More than the shared stacks, so the waiters are swapped out. */
+	ctx.value = 0;
+	coro_wait_group_add(&ctx.group, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new_shared(test_mutex_f, &ctx);
+	coro_wait_group_wait(&ctx.group);
+	unit_check(ctx.value == coro_count * ctx.iter_count &&
+		ctx.max_inside == 1, "mutex with shared stacks");
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+
+	ctx.max_inside = 0;
+	coro_wait_group_add(&ctx.group, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sem_f, &ctx);
+	coro_wait_group_wait(&ctx.group);
+	unit_check(ctx.max_inside == 3 && ctx.sem.count == 3, "semaphore");
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+
+	ctx.value = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_cond_f, &ctx);
+	coro_yield();
+	coro_mutex_lock(&ctx.mutex);
+	ctx.value = 1;
+	coro_cond_signal(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	coro_join(coros[0]);
+	unit_check(ctx.value == 0, "cond signal wakes up one");
+	coro_mutex_lock(&ctx.mutex);
+	ctx.value = coro_count - 1;
+	coro_cond_broadcast(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	for (int i = 1; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.value == 0, "cond broadcast wakes up all");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+struct test_sleep_ctx {
+	double duration;
+	double elapsed;
+	int id;
+	int *order;
+	int *order_size;
+};
+
+static void *
+test_sleep_f(void *arg)
+{
+	struct test_sleep_ctx *ctx = arg;
+	double start = test_now();
+	coro_sleep(ctx->duration);
+	ctx->elapsed = test_now() - start;
+	ctx->order[(*ctx->order_size)++] = ctx->id;
+	return NULL;
+}
+
+static void
+test_sleep(void)
+{
+	unit_test_start();
+
+	/* The longest one goes to a higher level of the wheel. */
+	double durations[] = {0.03, 0.01, 0.15};
+	struct test_sleep_ctx contexts[3];
+	struct coro *coros[3];
+	int order[3];
+	int order_size = 0;
+	for (int i = 0; i < 3; ++i) {
+		contexts[i].duration = durations[i];
+		contexts[i].id = i;
+		contexts[i].order = order;
+		contexts[i].order_size = &order_size;
+		coros[i] = coro_new(test_sleep_f, &contexts[i]);
+	}
+	coro_yield();
+	/* An explicit wakeup doesn't interrupt the sleep. */
+	coro_wakeup(coros[2]);
+	for (int i = 0; i < 3; ++i)
+		coro_join(coros[i]);
+	bool ok = true;
+	for (int i = 0; i < 3; ++i)
+		ok = ok && contexts[i].elapsed >= contexts[i].duration;
+	unit_check(ok, "sleep is not shorter than requested");
+	unit_check(contexts[2].elapsed < 1, "sleep is not much longer");
+	unit_check(order[0] == 1 && order[1] == 0 && order[2] == 2,
+		"sleepers wake up in the order of deadlines");
+
+	unit_test_finish();
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	double timeout = *(double *)arg;
+	return (void *)(long)coro_suspend_timeout(timeout);
+}
+
+static void
+test_suspend_timeout(void)
+{
+	unit_test_start();
+
+	double timeout = 10;
+	struct coro *c = coro_new(test_suspend_timeout_f, &timeout);
+	coro_yield();
+	double start = test_now();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)1, "woken up before the timeout");
+	unit_check(test_now() - start < 1, "not waited for the timeout");
+
+	timeout = 0.01;
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	unit_check(coro_join(c) == NULL, "timed out");
+
+	unit_test_finish();
+}
+
+static void *
+test_wait_fd_reader_f(void *arg)
+{
+	int fd = *(int *)arg;
+	if (coro_wait_fd(fd, CORO_FD_READ) != CORO_FD_READ)
+		return NULL;
+	char c;
+	if (read(fd, &c, 1) != 1 || c != 'x')
+		return NULL;
+	return arg;
+}
+
+static void
+test_wait_fd(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_assert(pipe(fds) == 0);
+	struct coro *reader = coro_new(test_wait_fd_reader_f, &fds[0]);
+	coro_yield();
+	unit_check(coro_wait_fd(fds[0], CORO_FD_READ) == -1,
+		"can't wait on a descriptor twice");
+	coro_sleep(0.01);
+	unit_check(write(fds[1], "x", 1) == 1, "write to the pipe");
+	unit_check(coro_join(reader) == &fds[0], "woken up by the data");
+	unit_check(coro_wait_fd(fds[1], CORO_FD_READ | CORO_FD_WRITE) ==
+		CORO_FD_WRITE, "ready for write");
+	close(fds[1]);
+	unit_check(coro_wait_fd(fds[0], CORO_FD_READ) == CORO_FD_READ,
+		"closed pipe is readable");
+	close(fds[0]);
+
+	unit_assert(pipe(fds) == 0);
+	reader = coro_new(test_wait_fd_reader_f, &fds[0]);
+	coro_yield();
+	unit_check(coro_close(fds[0]) == 0, "close a waited descriptor");
+	unit_check(coro_join(reader) == NULL, "the waiter is woken up");
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+static void *
+test_io_server_f(void *arg)
+{
+	int fd = *(int *)arg;
+	int conn = coro_accept(fd, NULL, NULL);
+	if (conn < 0)
+		return NULL;
+	char buf[16];
+	ssize_t rc = coro_read(conn, buf, sizeof(buf), -1);
+	close(conn);
+	if (rc != 4 || memcmp(buf, "ping", 4) != 0)
+		return NULL;
+	return arg;
+}
+
+struct test_io_ticker {
+	bool is_stopped;
+	int tick_count;
+};
+
+static void *
+test_io_ticker_f(void *arg)
+{
+	struct test_io_ticker *ticker = arg;
+	while (!ticker->is_stopped) {
+		++ticker->tick_count;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/libcoro_test_XXXXXX";
+	int fd = mkstemp(path);
+	unit_assert(fd >= 0);
+	unlink(path);
+	char buf[16];
+	unit_check(coro_write(fd, "hello world", 11, 0) == 11, "write");
+	unit_check(coro_fsync(fd) == 0, "fsync");
+	unit_check(coro_read(fd, buf, 5, 6) == 5 &&
+		memcmp(buf, "world", 5) == 0, "read at offset");
+	unit_check(coro_read(fd, buf, 5, -1) == 5 &&
+		memcmp(buf, "hello", 5) == 0 &&
+		coro_read(fd, buf, 16, -1) == 6 &&
+		memcmp(buf, " world", 6) == 0, "read at file position");
+	unit_check(coro_read(fd, buf, 16, -1) == 0, "read at the end");
+	close(fd);
+	unit_check(coro_read(fd, buf, 1, 0) == -1 && errno == EBADF,
+		"read of a closed descriptor");
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	unit_assert(listen_fd >= 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_size = sizeof(addr);
+	unit_assert(bind(listen_fd, (struct sockaddr *)&addr, addr_size) == 0);
+	unit_assert(getsockname(listen_fd, (struct sockaddr *)&addr,
+		&addr_size) == 0);
+	unit_assert(listen(listen_fd, 8) == 0);
+	struct test_io_ticker ticker = {false, 0};
+	struct coro *ticker_coro = coro_new(test_io_ticker_f, &ticker);
+	struct coro *server = coro_new(test_io_server_f, &listen_fd);
+	coro_sleep(0.01);
+	int tick_count = ticker.tick_count;
+	unit_check(tick_count > 0, "others run while accept waits");
+	int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+	unit_assert(client_fd >= 0);
+	unit_check(coro_connect(client_fd, (struct sockaddr *)&addr,
+		addr_size) == 0, "connect");
+	unit_check(coro_write(client_fd, "ping", 4, -1) == 4, "send");
+	unit_check(coro_join(server) == &listen_fd, "accept and receive");
+	ticker.is_stopped = true;
+	coro_join(ticker_coro);
+	close(client_fd);
+	close(listen_fd);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_mt_ctx {
+	int iter_count;
+	int sum;
+};
+
+static void *
+test_mt_child_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	coro_sleep(0.001);
+	for (int i = 0; i < ctx->iter_count; ++i)
+		coro_yield();
+	return arg;
+}
+
+static void *
+test_mt_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		struct coro *child = coro_new(test_mt_child_f, ctx);
+		coro_yield();
+		if (coro_join(child) == ctx)
+			++ctx->sum;
+	}
+	return arg;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	const int coro_count = 100;
+	struct coro *coros[coro_count];
+	struct test_mt_ctx contexts[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		contexts[i].iter_count = 100;
+		contexts[i].sum = 0;
+		coros[i] = coro_new(test_mt_f, &contexts[i]);
+	}
+	coro_sched_run_mt(4);
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i) {
+		ok = ok && coro_join(coros[i]) == &contexts[i];
+		ok = ok && contexts[i].sum == contexts[i].iter_count;
+	}
+	unit_check(ok, "all the coros are done in multiple threads");
+
+	unit_test_finish();
+}
+
+static void
+test_sync_mt(void)
+{
+	unit_test_start();
+
+	const int coro_count = 8;
+	struct coro *coros[coro_count];
+	struct test_sync_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.iter_count = 1000;
+	coro_mutex_create(&ctx.mutex);
+	coro_wait_group_create(&ctx.group);
+	coro_wait_group_add(&ctx.group, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mutex_f, &ctx);
+	coro_sched_run_mt(4);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.value == coro_count * ctx.iter_count, "mutex in threads");
+
+	unit_test_finish();
+}
+
+struct test_remote_task {
+	struct coro *coro;
+	bool is_slow;
+	int value;
+	int result;
+};
+
+static void *
+test_remote_thread_f(void *arg)
+{
+	struct test_remote_task *task = arg;
+	if (task->is_slow)
+		usleep(1000);
+	task->result = task->value * 2;
+	coro_wakeup_remote(task->coro);
+	return NULL;
+}
+
+/**
+ * Offload the work to a thread and wait for it. Half of the tasks
+ * are done before the coroutine even suspends.
+ */
+static void *
+test_remote_f(void *arg)
+{
+	int round_count = *(int *)arg;
+	bool ok = true;
+	for (int i = 0; i < round_count; ++i) {
+		struct test_remote_task task;
+		task.coro = coro_this();
+		task.is_slow = i % 2 == 0;
+		task.value = i;
+		task.result = -1;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, test_remote_thread_f,
+			&task) != 0)
+			return NULL;
+		coro_suspend_remote();
+		ok = ok && task.result == i * 2;
+		pthread_join(thread, NULL);
+	}
+	return ok ? arg : NULL;
+}
+
+static void
+test_wakeup_remote(void)
+{
+	unit_test_start();
+
+	/* Nothing else runs, the scheduler has to block for it. */
+	int round_count = 10;
+	unit_check(test_remote_f(&round_count) == &round_count,
+		"alone coro woken up from threads");
+
+	const int coro_count = 10;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_remote_f, &round_count);
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &round_count;
+	unit_check(ok, "many coros woken up from threads");
+
+	unit_test_finish();
+}
+
+struct test_io_mt_ctx {
+	int fd;
+	int round_count;
+	int next_id;
+};
+
+/** Write own block of the file and read it back, many times. */
+static void *
+test_io_mt_f(void *arg)
+{
+	struct test_io_mt_ctx *ctx = arg;
+	int id = __atomic_fetch_add(&ctx->next_id, 1, __ATOMIC_RELAXED);
+	off_t offset = id * sizeof(int);
+	for (int i = 0; i < ctx->round_count; ++i) {
+		int value = id * 1000 + i;
+		int got = -1;
+		if (coro_write(ctx->fd, &value, sizeof(value), offset) !=
+		    sizeof(value) ||
+		    coro_read(ctx->fd, &got, sizeof(got), offset) !=
+		    sizeof(got) || got != value)
+			return NULL;
+	}
+	return arg;
+}
+
+static void
+test_io_mt(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/libcoro_test_XXXXXX";
+	struct test_io_mt_ctx ctx;
+	ctx.fd = mkstemp(path);
+	unit_assert(ctx.fd >= 0);
+	unlink(path);
+	ctx.round_count = 100;
+	ctx.next_id = 0;
+	const int coro_count = 16;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_io_mt_f, &ctx);
+	coro_sched_run_mt(4);
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &ctx;
+	unit_check(ok, "file IO in multiple threads");
+	close(ctx.fd);
+
+	unit_test_finish();
+}
+
+struct test_mailbox_peer {
+	struct coro_engine *engine;
+	/** Closures received from the other peer. */
+	int recv_count;
+	/** recv_count when the last closure came. */
+	int last_count;
+	/** Coroutine started by the last closure. */
+	struct coro *last_coro;
+};
+
+struct test_mailbox_ctx {
+	struct test_mailbox_peer peers[2];
+	int msg_count;
+	int next_id;
+};
+
+static void
+test_mailbox_recv_f(void *arg)
+{
+	struct test_mailbox_peer *peer = arg;
+	++peer->recv_count;
+}
+
+static void *
+test_mailbox_last_coro_f(void *arg)
+{
+	struct test_mailbox_peer *peer = arg;
+	peer->last_count = peer->recv_count;
+	return NULL;
+}
+
+static void
+test_mailbox_last_f(void *arg)
+{
+	struct test_mailbox_peer *peer = arg;
+	peer->last_coro = coro_new(test_mailbox_last_coro_f, peer);
+}
+
+struct test_mailbox_sender {
+	struct coro_mailbox *box;
+	struct test_mailbox_peer *to;
+	int msg_count;
+};
+
+static void *
+test_mailbox_send_f(void *arg)
+{
+	struct test_mailbox_sender *sender = arg;
+	for (int i = 0; i <= sender->msg_count; ++i) {
+		coro_mailbox_f func = i < sender->msg_count ?
+			test_mailbox_recv_f : test_mailbox_last_f;
+		while (coro_mailbox_send(sender->box, func, sender->to) != 0) {
+			/* Let the receiver run, even on one CPU. */
+			sched_yield();
+			coro_yield();
+		}
+	}
+	coro_mailbox_close(sender->box);
+	return NULL;
+}
+
+/** Engine of its own, exchanging closures with the other one. */
+static void *
+test_mailbox_thread_f(void *arg)
+{
+	struct test_mailbox_ctx *ctx = arg;
+	int id = __atomic_fetch_add(&ctx->next_id, 1, __ATOMIC_RELAXED);
+	struct test_mailbox_peer *me = &ctx->peers[id];
+	struct test_mailbox_peer *peer = &ctx->peers[1 - id];
+	struct coro_engine *engine = coro_engine_new();
+	__atomic_store_n(&me->engine, engine, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&peer->engine, __ATOMIC_ACQUIRE) == NULL)
+		sched_yield();
+
+	struct test_mailbox_sender sender;
+	/* Small, to be full now and then. */
+	sender.box = coro_mailbox_new(peer->engine, 16);
+	sender.to = peer;
+	sender.msg_count = ctx->msg_count;
+	struct coro *c = coro_new(test_mailbox_send_f, &sender);
+	coro_engine_run(engine);
+	coro_join(c);
+	if (me->last_coro != NULL)
+		coro_join(me->last_coro);
+	coro_engine_delete(engine);
+	return NULL;
+}
+
+static void
+test_mailbox(void)
+{
+	unit_test_start();
+
+	struct test_mailbox_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.msg_count = 10000;
+	pthread_t threads[2];
+	for (int i = 0; i < 2; ++i) {
+		unit_assert(pthread_create(&threads[i], NULL,
+			test_mailbox_thread_f, &ctx) == 0);
+	}
+	for (int i = 0; i < 2; ++i)
+		pthread_join(threads[i], NULL);
+	bool ok = true;
+	for (int i = 0; i < 2; ++i) {
+		ok = ok && ctx.peers[i].recv_count == ctx.msg_count &&
+			ctx.peers[i].last_count == ctx.msg_count;
+	}
+	unit_check(ok, "closures exchanged by the engines in order");
+
+	unit_test_finish();
+}
+
+static void
+test_wakeup_remote_mt(void)
+{
+	unit_test_start();
+
+	const int coro_count = 16;
+	struct coro *coros[coro_count];
+	int round_count = 20;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_remote_f, &round_count);
+	coro_sched_run_mt(4);
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &round_count;
+	unit_check(ok, "coros woken up from threads in multiple threads");
+
+	unit_test_finish();
+}
+
+static void *
+test_preempt_hog_f(void *arg)
+{
+	volatile bool *is_stopped = arg;
+	while (!*is_stopped)
+		coro_check_preempt();
+	return NULL;
+}
+
+static void *
+test_preempt_stop_f(void *arg)
+{
+	volatile bool *is_stopped = arg;
+	*is_stopped = true;
+	return NULL;
+}
+
+/**
+ * Spin for a few time slices on the calls which never switch. The
+ * other coroutine must not run in between.
+ */
+static void *
+test_preempt_no_switch_f(void *arg)
+{
+	volatile bool *is_stopped = arg;
+	struct coro_sem sem;
+	coro_sem_create(&sem, 0);
+	struct coro_mutex mutex;
+	coro_mutex_create(&mutex);
+	struct timespec start, now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	do {
+		coro_wakeup(coro_this());
+		coro_sem_post(&sem);
+		coro_mutex_trylock(&mutex);
+		coro_mutex_unlock(&mutex);
+		if (*is_stopped)
+			return NULL;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000000L +
+		now.tv_nsec - start.tv_nsec < 20000000);
+	return arg;
+}
+
+static void
+test_preempt(void)
+{
+	unit_test_start();
+
+	unit_fail_if(coro_sched_set_preempt(0.001) != 0);
+	volatile bool is_stopped = false;
+	struct coro_sched_stats before, after;
+	coro_sched_stats(&before);
+	/* The hog runs first and would never let the other one run. */
+	struct coro *hog = coro_new(test_preempt_hog_f, (void *)&is_stopped);
+	struct coro *stop = coro_new(test_preempt_stop_f, (void *)&is_stopped);
+	coro_sched_run();
+	struct coro_stats stats;
+	coro_stats(hog, &stats);
+	unit_check(stats.preempt_count > 0, "the hog was preempted");
+	coro_sched_stats(&after);
+	unit_check(after.preempt_count > before.preempt_count,
+		"preemptions are counted");
+	coro_join(hog);
+	coro_join(stop);
+
+	is_stopped = false;
+	hog = coro_new(test_preempt_no_switch_f, (void *)&is_stopped);
+	stop = coro_new(test_preempt_stop_f, (void *)&is_stopped);
+	coro_sched_run();
+	unit_check(coro_join(hog) == &is_stopped,
+		"wakeups, unlocks and posts are not preempted");
+	coro_join(stop);
+	unit_fail_if(coro_sched_set_preempt(0) != 0);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -169,8 +1444,25 @@ coro_main_f(void *arg)
 	test_suspend();
 	test_loop_of_yields();
 	test_wakup_self();
+	test_wakeup_and_switch();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_many_coros();
+	test_stack_size();
+	test_new_many();
+	test_shared_stack();
+	test_stack_usage();
+	test_specific();
+	test_generator();
+	test_priority();
+	test_stats();
+	test_trace();
+	test_sync();
+	test_sleep();
+	test_suspend_timeout();
+	test_wait_fd();
+	test_io();
+	test_wakeup_remote();
 	return NULL;
 }
 
@@ -182,6 +1474,12 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_mt();
+	test_sync_mt();
+	test_wakeup_remote_mt();
+	test_io_mt();
+	test_mailbox();
+	test_preempt();
 	coro_sched_destroy();
 	return 0;
 }
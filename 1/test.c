@@ -3,6 +3,8 @@
 #include "unit.h"
 #include "corobus.h"
 
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -182,6 +184,17 @@ test_channel_reopen(void)
 	}
 	coro_bus_channel_close(bus, c1);
 
+	unit_msg("a stale descriptor doesn't reach a reopened channel");
+	c1 = coro_bus_channel_open(bus, 2);
+	coro_bus_channel_close(bus, c1);
+	c2 = coro_bus_channel_open(bus, 2);
+	unit_assert(c2 >= 0 && c2 != c1);
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c2);
+
 	coro_bus_delete(bus);
 	unit_test_finish();
 }
@@ -1600,6 +1613,549 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct ctx_send_ptr {
+	struct coro_bus *bus;
+	int channel;
+	void *ptr;
+	size_t size;
+	int rc;
+	bool is_done;
+};
+
+static void *
+send_ptr_f(void *arg)
+{
+	struct ctx_send_ptr *ctx = arg;
+	ctx->rc = coro_bus_send_ptr(ctx->bus, ctx->channel, ctx->ptr,
+		ctx->size);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_msg_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_msg(bus, 5, SIZE_MAX);
+	unit_assert(c1 >= 0);
+
+	unit_msg("a pointer is passed as is");
+	char *ptr = malloc(100);
+	strcpy(ptr, "pointer");
+	unit_assert(coro_bus_send_ptr(bus, c1, ptr, 100) == 0);
+	void *out = NULL;
+	size_t size = 0;
+	unit_assert(coro_bus_recv_ptr(bus, c1, &out, &size) == 0);
+	unit_assert(out == ptr && size == 100);
+	free(out);
+
+	unit_msg("small and big bytes");
+	char big[1000];
+	memset(big, 'x', sizeof(big));
+	unit_assert(coro_bus_send_bytes(bus, c1, "small", 6) == 0);
+	unit_assert(coro_bus_send_bytes(bus, c1, big, sizeof(big)) == 0);
+	unit_assert(coro_bus_send_bytes(bus, c1, "as pointer", 11) == 0);
+	char buf[2000];
+	unit_assert(coro_bus_recv_bytes(bus, c1, buf, sizeof(buf)) == 6);
+	unit_assert(strcmp(buf, "small") == 0);
+	memset(buf, 0, sizeof(buf));
+	unit_assert(coro_bus_recv_bytes(bus, c1, buf, 10) == sizeof(big));
+	unit_assert(memcmp(buf, big, 10) == 0 && buf[10] == 0);
+	unit_assert(coro_bus_recv_ptr(bus, c1, &out, &size) == 0);
+	unit_assert(size == 11 && strcmp(out, "as pointer") == 0);
+	free(out);
+	unit_assert(coro_bus_try_recv_bytes(bus, c1, buf, sizeof(buf)) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("wrong types");
+	unsigned data = 0;
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	int c2 = coro_bus_channel_open(bus, 5);
+	unit_assert(coro_bus_try_send_bytes(bus, c2, "x", 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	coro_bus_channel_close(bus, c2);
+
+	unit_msg("pending messages are freed with the channel");
+	unit_assert(coro_bus_send_ptr(bus, c1, malloc(10), 10) == 0);
+	unit_assert(coro_bus_send_bytes(bus, c1, big, sizeof(big)) == 0);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_msg_byte_limit(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_msg(bus, 10, 100);
+	unit_assert(c1 >= 0);
+
+	unit_msg("a message bigger than the limit fits an empty channel");
+	char buf[200] = {0};
+	unit_assert(coro_bus_try_send_bytes(bus, c1, buf, 200) == 0);
+	unit_assert(coro_bus_try_send_bytes(bus, c1, buf, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_bytes(bus, c1, buf, sizeof(buf)) == 200);
+
+	unit_msg("the bytes are limited, not the count");
+	unit_assert(coro_bus_try_send_bytes(bus, c1, buf, 60) == 0);
+	unit_assert(coro_bus_try_send_bytes(bus, c1, buf, 60) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send_bytes(bus, c1, buf, 40) == 0);
+
+	unit_msg("a sender waits for the bytes to be freed");
+	struct ctx_send_ptr ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.size = 50;
+	ctx.ptr = malloc(ctx.size);
+	ctx.rc = -1;
+	ctx.is_done = false;
+	struct coro *worker = coro_new(send_ptr_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv_bytes(bus, c1, buf, sizeof(buf)) == 60);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.is_done && ctx.rc == 0);
+	unit_assert(coro_bus_recv_bytes(bus, c1, buf, sizeof(buf)) == 40);
+	void *out = NULL;
+	size_t size = 0;
+	unit_assert(coro_bus_recv_ptr(bus, c1, &out, &size) == 0);
+	unit_assert(out == ctx.ptr && size == 50);
+	free(out);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	struct coro_bus_op ops[2];
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->ops, 2);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start(struct ctx_select *ctx, struct coro_bus *bus, int recv1,
+	int recv2)
+{
+	ctx->bus = bus;
+	ctx->ops[0].type = CORO_BUS_OP_RECV;
+	ctx->ops[0].channel = recv1;
+	ctx->ops[0].data = 0;
+	ctx->ops[1].type = CORO_BUS_OP_RECV;
+	ctx->ops[1].channel = recv2;
+	ctx->ops[1].data = 0;
+	ctx->rc = -2;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select_try(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	struct coro_bus_op ops[3];
+	ops[0].type = CORO_BUS_OP_RECV;
+	ops[0].channel = c1;
+	ops[1].type = CORO_BUS_OP_RECV;
+	ops[1].channel = c2;
+	ops[2].type = CORO_BUS_OP_SEND;
+	ops[2].channel = c1;
+	ops[2].data = 10;
+
+	unit_msg("the first ready operation is done");
+	unit_assert(coro_bus_try_select(bus, ops, 2) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_select(bus, ops, 3) == 2);
+	unit_assert(coro_bus_try_send(bus, c2, 20) == 0);
+	unit_assert(coro_bus_try_select(bus, ops, 3) == 0);
+	unit_assert(ops[0].data == 10);
+	unit_assert(coro_bus_try_select(bus, ops, 3) == 1);
+	unit_assert(ops[1].data == 20);
+
+	unit_msg("bad operations");
+	unit_assert(coro_bus_try_select(bus, ops, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	ops[1].channel = c2 + 1;
+	unit_assert(coro_bus_try_select(bus, ops, 3) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	ops[1].channel = coro_bus_channel_open_msg(bus, 1, 1);
+	unit_assert(coro_bus_try_select(bus, ops, 3) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	coro_bus_channel_close(bus, ops[1].channel);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_select_blocking(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+
+	unit_msg("any of the channels wakes the select up");
+	struct ctx_select ctx;
+	select_start(&ctx, bus, c1, c2);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, c2, 5) == 0);
+	unit_assert(select_join(&ctx) == 1);
+	unit_assert(ctx.ops[1].data == 5);
+
+	unit_msg("many waiting selects");
+	struct ctx_select ctx2;
+	select_start(&ctx, bus, c1, c2);
+	select_start(&ctx2, bus, c2, c1);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 6) == 0);
+	unit_assert(coro_bus_send(bus, c2, 7) == 0);
+	unit_assert(select_join(&ctx) >= 0);
+	unit_assert(select_join(&ctx2) >= 0);
+	unit_assert(ctx.ops[ctx.rc].data + ctx2.ops[ctx2.rc].data == 13);
+
+	unit_msg("an unused wakeup is passed on");
+	/* The select wakes up by c1, but takes c2. */
+	select_start(&ctx, bus, c2, c1);
+	unsigned data = 0;
+	struct ctx_recv ctx_recv;
+	recv_start(&ctx_recv, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_try_send(bus, c1, 8) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 9) == 0);
+	unit_assert(select_join(&ctx) == 0);
+	unit_assert(ctx.ops[0].data == 9);
+	unit_assert(recv_join(&ctx_recv) == 0);
+	unit_assert(data == 8);
+
+	unit_msg("closed channel");
+	select_start(&ctx, bus, c1, c2);
+	coro_yield();
+	coro_bus_channel_close(bus, c2);
+	unit_assert(select_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_mt_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new_mt();
+
+	unit_msg("the limit is rounded up to a power of 2");
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data = 0;
+	for (unsigned i = 0; i < 4; ++i) {
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("batches");
+	unsigned batch[6] = {1, 2, 3, 4, 5, 6};
+	unit_assert(coro_bus_send_v(bus, c1, batch, 6) == 4);
+	unit_assert(coro_bus_try_send_v(bus, c1, batch, 6) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	memset(batch, 0, sizeof(batch));
+	unit_assert(coro_bus_recv_v(bus, c1, batch, 3) == 3);
+	unit_assert(batch[0] == 1 && batch[1] == 2 && batch[2] == 3);
+	unit_assert(coro_bus_try_recv_v(bus, c1, batch, 3) == 1);
+	unit_assert(batch[0] == 4);
+
+	unit_msg("a single message limit");
+	int c3 = coro_bus_channel_open(bus, 1);
+	unit_assert(c3 >= 0);
+	unit_assert(coro_bus_try_send(bus, c3, 10) == 0);
+	unit_assert(coro_bus_try_send(bus, c3, 11) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0);
+	unit_assert(data == 10);
+	unit_assert(coro_bus_try_recv(bus, c3, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send(bus, c3, 12) == 0);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0);
+	unit_assert(data == 12);
+	coro_bus_channel_close(bus, c3);
+
+	unit_msg("not supported");
+	unit_assert(coro_bus_broadcast(bus, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	unit_assert(coro_bus_channel_open_msg(bus, 1, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	struct coro_bus_op op = {CORO_BUS_OP_RECV, c1, 0};
+	unit_assert(coro_bus_try_select(bus, &op, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+
+	unit_msg("a stale descriptor");
+	coro_bus_channel_close(bus, c1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0 && c2 != c1);
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel_close(bus, c2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+/** Number of the messages sent by each producer. */
+#define MT_MSG_COUNT 20000
+
+/** The message to stop a consumer. */
+#define MT_STOP UINT_MAX
+
+struct ctx_mt {
+	struct coro_bus *bus;
+	int channel;
+	/** Producer id, its messages are id * MT_MSG_COUNT + i. */
+	unsigned id;
+	/** How many messages to receive, or 0 to wait for MT_STOP. */
+	unsigned count;
+	unsigned long long sum;
+	unsigned received;
+	bool is_failed;
+};
+
+static void
+mt_produce(struct ctx_mt *ctx)
+{
+	for (unsigned i = 0; i < MT_MSG_COUNT; ++i) {
+		if (coro_bus_send(ctx->bus, ctx->channel,
+				  ctx->id * MT_MSG_COUNT + i) != 0)
+			ctx->is_failed = true;
+	}
+}
+
+static void
+mt_consume(struct ctx_mt *ctx)
+{
+	ctx->sum = 0;
+	ctx->received = 0;
+	while (ctx->count == 0 || ctx->received < ctx->count) {
+		unsigned data;
+		if (coro_bus_recv(ctx->bus, ctx->channel, &data) != 0) {
+			ctx->is_failed = true;
+			return;
+		}
+		if (data == MT_STOP)
+			return;
+		ctx->sum += data;
+		++ctx->received;
+	}
+}
+
+static void *
+mt_produce_f(void *arg)
+{
+	mt_produce(arg);
+	return NULL;
+}
+
+static void *
+mt_consume_f(void *arg)
+{
+	mt_consume(arg);
+	return NULL;
+}
+
+/** Sum of all the messages of the given number of producers. */
+static unsigned long long
+mt_expected_sum(unsigned producer_count)
+{
+	unsigned long long n = producer_count * MT_MSG_COUNT;
+	return n * (n - 1) / 2;
+}
+
+static void
+test_mt_threads(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new_mt();
+	int c1 = coro_bus_channel_open(bus, 16);
+	enum { THREAD_COUNT = 4 };
+	struct ctx_mt producers[THREAD_COUNT];
+	struct ctx_mt consumers[THREAD_COUNT];
+	pthread_t producer_threads[THREAD_COUNT];
+	pthread_t consumer_threads[THREAD_COUNT];
+
+	unit_msg("plain threads send and receive");
+	for (unsigned i = 0; i < THREAD_COUNT; ++i) {
+		struct ctx_mt *c = &consumers[i];
+		memset(c, 0, sizeof(*c));
+		c->bus = bus;
+		c->channel = c1;
+		unit_assert(pthread_create(&consumer_threads[i], NULL,
+			mt_consume_f, c) == 0);
+		struct ctx_mt *p = &producers[i];
+		memset(p, 0, sizeof(*p));
+		p->bus = bus;
+		p->channel = c1;
+		p->id = i;
+		unit_assert(pthread_create(&producer_threads[i], NULL,
+			mt_produce_f, p) == 0);
+	}
+	for (unsigned i = 0; i < THREAD_COUNT; ++i) {
+		pthread_join(producer_threads[i], NULL);
+		unit_assert(!producers[i].is_failed);
+	}
+	unit_msg("the coroutine waits for the threads to make space");
+	for (unsigned i = 0; i < THREAD_COUNT; ++i)
+		unit_assert(coro_bus_send(bus, c1, MT_STOP) == 0);
+	unsigned long long sum = 0;
+	unsigned received = 0;
+	for (unsigned i = 0; i < THREAD_COUNT; ++i) {
+		pthread_join(consumer_threads[i], NULL);
+		unit_assert(!consumers[i].is_failed);
+		sum += consumers[i].sum;
+		received += consumers[i].received;
+	}
+	unit_assert(received == THREAD_COUNT * MT_MSG_COUNT);
+	unit_assert(sum == mt_expected_sum(THREAD_COUNT));
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_mt_engine {
+	struct ctx_mt producers[4];
+	pthread_t thread;
+};
+
+static void *
+mt_produce_coro_f(void *arg)
+{
+	mt_produce(arg);
+	return NULL;
+}
+
+/** A thread running its own engine with the producer coroutines. */
+static void *
+mt_engine_f(void *arg)
+{
+	struct ctx_mt_engine *ctx = arg;
+	struct coro_engine *engine = coro_engine_new();
+	struct coro *coros[4];
+	for (int i = 0; i < 4; ++i)
+		coros[i] = coro_new(mt_produce_coro_f, &ctx->producers[i]);
+	coro_engine_run(engine);
+	for (int i = 0; i < 4; ++i)
+		coro_join(coros[i]);
+	coro_engine_delete(engine);
+	return NULL;
+}
+
+static void *
+mt_consume_coro_f(void *arg)
+{
+	mt_consume(arg);
+	return NULL;
+}
+
+static void
+test_mt_engines(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new_mt();
+	int c1 = coro_bus_channel_open(bus, 8);
+	enum { ENGINE_COUNT = 2, CONSUMER_COUNT = 4 };
+
+	unit_msg("coroutines of different engines");
+	struct ctx_mt_engine engines[ENGINE_COUNT];
+	for (unsigned i = 0; i < ENGINE_COUNT; ++i) {
+		for (unsigned j = 0; j < 4; ++j) {
+			struct ctx_mt *p = &engines[i].producers[j];
+			memset(p, 0, sizeof(*p));
+			p->bus = bus;
+			p->channel = c1;
+			p->id = i * 4 + j;
+		}
+		unit_assert(pthread_create(&engines[i].thread, NULL,
+			mt_engine_f, &engines[i]) == 0);
+	}
+	struct ctx_mt consumers[CONSUMER_COUNT];
+	struct coro *coros[CONSUMER_COUNT];
+	for (unsigned i = 0; i < CONSUMER_COUNT; ++i) {
+		struct ctx_mt *c = &consumers[i];
+		memset(c, 0, sizeof(*c));
+		c->bus = bus;
+		c->channel = c1;
+		c->count = ENGINE_COUNT * 4 * MT_MSG_COUNT / CONSUMER_COUNT;
+		coros[i] = coro_new(mt_consume_coro_f, c);
+	}
+	unsigned long long sum = 0;
+	for (unsigned i = 0; i < CONSUMER_COUNT; ++i) {
+		unit_assert(coro_join(coros[i]) == NULL);
+		unit_assert(!consumers[i].is_failed);
+		sum += consumers[i].sum;
+	}
+	for (unsigned i = 0; i < ENGINE_COUNT; ++i) {
+		pthread_join(engines[i].thread, NULL);
+		for (unsigned j = 0; j < 4; ++j)
+			unit_assert(!engines[i].producers[j].is_failed);
+	}
+	unit_assert(sum == mt_expected_sum(ENGINE_COUNT * 4));
+	unsigned data;
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -1632,6 +2188,16 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+
+	test_msg_basic();
+	test_msg_byte_limit();
+
+	test_select_try();
+	test_select_blocking();
+
+	test_mt_basic();
+	test_mt_threads();
+	test_mt_engines();
 	return NULL;
 }
 